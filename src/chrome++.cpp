@@ -11,6 +11,7 @@ HMODULE hInstance;
 
 #include "hijack.h"
 #include "utils.h"
+#include "sigcache.h"
 #include "patch.h"
 #include "config.h"
 #include "tabbookmark.h"
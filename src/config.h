@@ -81,6 +81,29 @@ bool IsWin32K() {
          0;
 }
 
+// Extra rules for patching resources.pak
+std::wstring GetPakRulesPath() {
+  auto path = GetIniString(L"general", L"pak_rules", L"");
+  if (path.empty()) {
+    return path;
+  }
+  path = ExpandEnvironmentPath(path);
+  ReplaceStringInPlace(path, L"%app%", GetAppDir());
+  return GetAbsolutePath(path);
+}
+
+// Write a new resources.pak instead of patching it in place
+bool IsPakRebuild() {
+  return ::GetPrivateProfileIntW(L"general", L"pak_rebuild", 0,
+                                 kIniPath.c_str()) != 0;
+}
+
+// Keep resources.pak mapped read-only with the patched parts in private memory
+bool IsPakOverlay() {
+  return ::GetPrivateProfileIntW(L"general", L"pak_overlay", 0,
+                                 kIniPath.c_str()) != 0;
+}
+
 bool IsKeepLastTab() {
   return ::GetPrivateProfileIntW(L"tabs", L"keep_last_tab", 1,
                                  kIniPath.c_str()) != 0;
@@ -142,4 +165,18 @@ std::wstring GetDisableTabName() {
   return GetIniString(L"tabs", L"new_tab_disable_name", L"");
 }
 
+// The names of GetDisableTabName(), split at commas and unquoted once. They
+// are checked on every mouse event.
+const std::vector<std::wstring_view>& GetDisableTabNames() {
+  static const std::wstring names = GetDisableTabName();
+  static const std::vector<std::wstring_view> views = []() {
+    std::vector<std::wstring_view> views;
+    for (std::wstring_view name : Tokenizer<wchar_t>(names, L',', L"\"")) {
+      views.push_back(name);
+    }
+    return views;
+  }();
+  return views;
+}
+
 #endif  // CONFIG_H_
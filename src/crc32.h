@@ -0,0 +1,234 @@
+#ifndef CRC32_H_
+#define CRC32_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+#define CRC32_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define CRC32_ARM64 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <arm_acle.h>
+#endif
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/auxv.h>
+#endif
+#endif
+
+// The CRC-32 of gzip (reflected polynomial 0xEDB88320), continuing from
+// `crc` like zlib's crc32(): start with 0 and pass each result back in.
+//
+// The kernels are CLMUL folding on x86 (Intel's "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ"), the CRC32 instructions on ARMv8 and
+// slicing-by-8 everywhere else.
+
+#if defined(CRC32_X86) && !defined(_MSC_VER)
+#define CRC32_TARGET_PCLMUL __attribute__((target("pclmul,sse4.1")))
+#else
+#define CRC32_TARGET_PCLMUL
+#endif
+
+#if defined(CRC32_ARM64) && !defined(_MSC_VER)
+#define CRC32_TARGET_ARMV8 __attribute__((target("+crc")))
+#else
+#define CRC32_TARGET_ARMV8
+#endif
+
+typedef uint32_t (*Crc32Kernel)(uint32_t crc, const uint8_t* data, size_t size);
+
+struct Crc32Tables {
+  uint32_t table[8][256];
+
+  Crc32Tables() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = c & 1 ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+      }
+      table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+      for (int s = 1; s < 8; ++s) {
+        uint32_t c = table[s - 1][i];
+        table[s][i] = (c >> 8) ^ table[0][c & 0xFF];
+      }
+    }
+  }
+};
+
+static const Crc32Tables& GetCrc32Tables() {
+  static const Crc32Tables tables;
+  return tables;
+}
+
+static uint32_t Crc32Slicing(uint32_t crc, const uint8_t* data, size_t size) {
+  const auto& t = GetCrc32Tables().table;
+  crc = ~crc;
+  for (; size >= 8; data += 8, size -= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, data, 4);
+    memcpy(&hi, data + 4, 4);
+    lo ^= crc;
+    crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^
+          t[4][lo >> 24] ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+          t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+  }
+  for (; size; ++data, --size) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xFF];
+  }
+  return ~crc;
+}
+
+#ifdef CRC32_X86
+// Fold the 128 bits of x onto the next 128 with the constant pair k.
+CRC32_TARGET_PCLMUL static inline __m128i Crc32FoldLane(__m128i x,
+                                                        __m128i next,
+                                                        __m128i k) {
+  __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+  __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+  return _mm_xor_si128(_mm_xor_si128(hi, next), lo);
+}
+
+// Fold `size` bytes, a multiple of 16 and at least 64, into the inverted
+// CRC `crc` and return the inverted result. Four 128-bit lanes are folded
+// 64 bytes ahead with k1k2, then into one with k3k4, reduced to 64 bits
+// with k5 and to 32 bits by Barrett reduction with the polynomial and mu.
+CRC32_TARGET_PCLMUL static uint32_t Crc32Fold(uint32_t crc,
+                                              const uint8_t* data,
+                                              size_t size) {
+  alignas(16) static const uint64_t k1k2[] = {0x154442bd4, 0x1c6e41596};
+  alignas(16) static const uint64_t k3k4[] = {0x1751997d0, 0x0ccaa009e};
+  alignas(16) static const uint64_t k5k0[] = {0x163cd6124, 0x000000000};
+  alignas(16) static const uint64_t poly[] = {0x1db710641, 0x1f7011641};
+
+  __m128i x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+  __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+  __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+  __m128i x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+  __m128i k = _mm_load_si128((const __m128i*)k1k2);
+  data += 64;
+  size -= 64;
+
+  for (; size >= 64; data += 64, size -= 64) {
+    x1 = Crc32FoldLane(x1, _mm_loadu_si128((const __m128i*)(data + 0x00)), k);
+    x2 = Crc32FoldLane(x2, _mm_loadu_si128((const __m128i*)(data + 0x10)), k);
+    x3 = Crc32FoldLane(x3, _mm_loadu_si128((const __m128i*)(data + 0x20)), k);
+    x4 = Crc32FoldLane(x4, _mm_loadu_si128((const __m128i*)(data + 0x30)), k);
+  }
+
+  k = _mm_load_si128((const __m128i*)k3k4);
+  x1 = Crc32FoldLane(x1, x2, k);
+  x1 = Crc32FoldLane(x1, x3, k);
+  x1 = Crc32FoldLane(x1, x4, k);
+  for (; size >= 16; data += 16, size -= 16) {
+    x1 = Crc32FoldLane(x1, _mm_loadu_si128((const __m128i*)data), k);
+  }
+
+  // 128 to 64 bits.
+  __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+  x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  k = _mm_loadl_epi64((const __m128i*)k5k0);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits.
+  k = _mm_load_si128((const __m128i*)poly);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), k, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t Crc32Pclmul(uint32_t crc, const uint8_t* data, size_t size) {
+  if (size >= 64) {
+    size_t folded = size & ~(size_t)15;
+    crc = ~Crc32Fold(~crc, data, folded);
+    data += folded;
+    size -= folded;
+  }
+  return Crc32Slicing(crc, data, size);
+}
+
+static bool CpuSupportsPclmul() {
+  const unsigned kPclmul = 1u << 1;
+  const unsigned kSse41 = 1u << 19;
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & kPclmul) != 0 && (info[2] & kSse41) != 0;
+#else
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (ecx & kPclmul) != 0 && (ecx & kSse41) != 0;
+#endif
+}
+#endif  // CRC32_X86
+
+#ifdef CRC32_ARM64
+CRC32_TARGET_ARMV8 static uint32_t Crc32Armv8(uint32_t crc,
+                                              const uint8_t* data,
+                                              size_t size) {
+  crc = ~crc;
+  for (; size >= 8; data += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    crc = __crc32d(crc, word);
+  }
+  for (; size; ++data, --size) {
+    crc = __crc32b(crc, *data);
+  }
+  return ~crc;
+}
+
+static bool CpuSupportsCrc32() {
+#if defined(_WIN32)
+  return IsProcessorFeaturePresent(PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE) !=
+         FALSE;
+#elif defined(__linux__)
+  const unsigned long kHwcapCrc32 = 1ul << 7;
+  return (getauxval(AT_HWCAP) & kHwcapCrc32) != 0;
+#elif defined(__ARM_FEATURE_CRC32)
+  return true;
+#else
+  return false;
+#endif
+}
+#endif  // CRC32_ARM64
+
+// Pick the fastest kernel the CPU supports, once per process.
+static Crc32Kernel GetCrc32Kernel() {
+  static const Crc32Kernel kernel = []() -> Crc32Kernel {
+#if defined(CRC32_X86)
+    if (CpuSupportsPclmul())
+      return Crc32Pclmul;
+#elif defined(CRC32_ARM64)
+    if (CpuSupportsCrc32())
+      return Crc32Armv8;
+#endif
+    return Crc32Slicing;
+  }();
+  return kernel;
+}
+
+static uint32_t Crc32(uint32_t crc, const uint8_t* data, size_t size) {
+  return GetCrc32Kernel()(crc, data, size);
+}
+
+#endif  // CRC32_H_
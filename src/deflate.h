@@ -0,0 +1,648 @@
+#ifndef DEFLATE_H_
+#define DEFLATE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static inline unsigned FloorLog2(uint32_t value) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanReverse(&index, value);
+  return index;
+#else
+  return 31 - __builtin_clz(value);
+#endif
+}
+
+static inline unsigned CountTrailingZeros64(uint64_t value) {
+#if defined(_MSC_VER) && defined(_WIN64)
+  unsigned long index;
+  _BitScanForward64(&index, value);
+  return index;
+#elif defined(_MSC_VER)
+  unsigned long index;
+  if ((uint32_t)value) {
+    _BitScanForward(&index, (uint32_t)value);
+    return index;
+  }
+  _BitScanForward(&index, (uint32_t)(value >> 32));
+  return 32 + index;
+#else
+  return __builtin_ctzll(value);
+#endif
+}
+
+// A raw deflate (RFC 1951) compressor made for rewriting resources in place:
+// the output goes straight into a fixed buffer and compression gives up as
+// soon as it overflows, and bytes before the input can serve as the
+// dictionary without being emitted.
+//
+// Matches of 4 to 258 bytes are found through a hash of 4 bytes with chains
+// as deep as the level asks, optionally with one step of lazy matching. Each
+// block is written dynamic, fixed or stored, whichever is smallest, so the
+// output inflates with any decoder.
+class FastDeflater {
+ public:
+  // Compress `size` bytes at `data` into at most `capacity` bytes at `out`.
+  // Matches may reach back into the `primed` bytes before `data`. `level`
+  // 1 to 9 trades speed for size as in zlib. Returns the compressed size, 0
+  // if it does not fit.
+  size_t Compress(const uint8_t* data,
+                  size_t size,
+                  size_t primed,
+                  int level,
+                  uint8_t* out,
+                  size_t capacity) {
+    if (head_.empty()) {
+      head_.resize(1 << kHashBits);
+      prev_.resize(kWindowSize);
+      symbols_.reserve(kBlockSymbols);
+    }
+    std::fill(head_.begin(), head_.end(), -1);
+    symbols_.clear();
+    ResetFrequencies();
+    SetLevel(level);
+
+    base_ = data - primed;
+    end_ = primed + size;
+    writer_ = {out, capacity};
+    for (size_t pos = primed > kWindowSize ? primed - kWindowSize : 0;
+         pos < primed; ++pos) {
+      Insert(pos);
+    }
+
+    size_t block_start = primed;
+    size_t pos = primed;
+    while (pos < end_) {
+      size_t distance = 0;
+      size_t length = FindMatch(pos, &distance);
+      Insert(pos);
+      if (length && lazy_ && length < nice_) {
+        // Take a literal instead if the next byte starts a longer match.
+        size_t next_distance;
+        if (FindMatch(pos + 1, &next_distance) > length)
+          length = 0;
+      }
+      if (length) {
+        EmitMatch(length, distance);
+        if (length <= max_insert_) {
+          for (size_t i = 1; i < length; ++i) {
+            Insert(pos + i);
+          }
+        }
+        pos += length;
+      } else {
+        EmitLiteral(base_[pos]);
+        ++pos;
+      }
+
+      if (symbols_.size() >= kBlockSymbols) {
+        FlushBlock(block_start, pos, false);
+        block_start = pos;
+        if (writer_.overflow)
+          return 0;
+      }
+    }
+    FlushBlock(block_start, end_, true);
+    return writer_.Finish();
+  }
+
+ private:
+  static constexpr size_t kWindowSize = 32 * 1024;
+  static constexpr int kHashBits = 15;
+  static constexpr size_t kMinMatch = 4;
+  static constexpr size_t kMaxMatch = 258;
+  static constexpr size_t kBlockSymbols = 16 * 1024;
+  static constexpr int kLiteralCodes = 286;
+  static constexpr int kDistanceCodes = 30;
+
+  struct Symbol {
+    // The literal byte if distance is 0, else the match length.
+    uint16_t length;
+    uint16_t distance;
+  };
+
+  // Writes bits least significant first, 32 at a time. Bytes past the
+  // capacity are dropped and flag an overflow.
+  struct BitWriter {
+    uint8_t* out = nullptr;
+    size_t capacity = 0;
+    size_t pos = 0;
+    uint64_t bits = 0;
+    int count = 0;
+    bool overflow = false;
+
+    BitWriter() = default;
+    BitWriter(uint8_t* out, size_t capacity) : out(out), capacity(capacity) {}
+
+    void Put(uint32_t value, int n) {
+      bits |= (uint64_t)value << count;
+      count += n;
+      if (count >= 32) {
+        if (capacity - pos >= 4) {
+          memcpy(out + pos, &bits, 4);
+          pos += 4;
+        } else {
+          overflow = true;
+        }
+        bits >>= 32;
+        count -= 32;
+      }
+    }
+
+    // Pad to a byte boundary and write out all pending bits.
+    void Align() {
+      count = (count + 7) & ~7;
+      for (; count > 0; count -= 8) {
+        if (pos < capacity) {
+          out[pos++] = (uint8_t)bits;
+        } else {
+          overflow = true;
+        }
+        bits >>= 8;
+      }
+      count = 0;
+    }
+
+    void PutBytes(const uint8_t* data, size_t size) {
+      if (size > capacity - pos) {
+        overflow = true;
+        size = capacity - pos;
+      }
+      memcpy(out + pos, data, size);
+      pos += size;
+    }
+
+    size_t Finish() {
+      Align();
+      return overflow ? 0 : pos;
+    }
+  };
+
+  void SetLevel(int level) {
+    if (level <= 1) {
+      chain_ = 1;
+      lazy_ = false;
+      nice_ = 32;
+      max_insert_ = 4;
+    } else if (level <= 5) {
+      chain_ = 8;
+      lazy_ = false;
+      nice_ = 64;
+      max_insert_ = kMaxMatch;
+    } else if (level <= 8) {
+      chain_ = 32;
+      lazy_ = true;
+      nice_ = 128;
+      max_insert_ = kMaxMatch;
+    } else {
+      chain_ = 256;
+      lazy_ = true;
+      nice_ = kMaxMatch;
+      max_insert_ = kMaxMatch;
+    }
+  }
+
+  uint32_t Hash(size_t pos) const {
+    uint32_t value;
+    memcpy(&value, base_ + pos, 4);
+    return (value * 2654435761u) >> (32 - kHashBits);
+  }
+
+  void Insert(size_t pos) {
+    if (pos + kMinMatch > end_)
+      return;
+    uint32_t hash = Hash(pos);
+    prev_[pos & (kWindowSize - 1)] = head_[hash];
+    head_[hash] = (int32_t)pos;
+  }
+
+  size_t MatchLength(const uint8_t* a, const uint8_t* b, size_t limit) const {
+    size_t length = 0;
+    for (; length + 8 <= limit; length += 8) {
+      uint64_t x, y;
+      memcpy(&x, a + length, 8);
+      memcpy(&y, b + length, 8);
+      if (x != y)
+        return length + CountTrailingZeros64(x ^ y) / 8;
+    }
+    while (length < limit && a[length] == b[length]) {
+      ++length;
+    }
+    return length;
+  }
+
+  // The longest match for `pos` among the positions inserted so far, 0 if
+  // there is none of at least kMinMatch bytes.
+  size_t FindMatch(size_t pos, size_t* distance) const {
+    size_t limit = (std::min)(kMaxMatch, end_ - pos);
+    if (limit < kMinMatch)
+      return 0;
+    size_t best = kMinMatch - 1;
+    int32_t candidate = head_[Hash(pos)];
+    for (int chain = chain_; candidate >= 0 && chain > 0; --chain) {
+      // Chains may run into slots reused for newer positions, which are
+      // still valid candidates; anything out of the window ends the chain.
+      size_t offset = pos - (size_t)candidate;
+      if (!offset || offset > kWindowSize)
+        break;
+      const uint8_t* match = base_ + candidate;
+      if (match[best] == base_[pos + best]) {
+        size_t length = MatchLength(match, base_ + pos, limit);
+        if (length > best) {
+          best = length;
+          *distance = offset;
+          if (length >= nice_ || length == limit)
+            break;
+        }
+      }
+      candidate = prev_[candidate & (kWindowSize - 1)];
+    }
+    return best >= kMinMatch ? best : 0;
+  }
+
+  static int LengthCode(size_t length) {
+    uint32_t value = (uint32_t)(length - 3);
+    if (value < 8)
+      return (int)value;
+    if (value == 255)
+      return 28;
+    unsigned bits = FloorLog2(value);
+    return (int)(4 * (bits - 1) + ((value >> (bits - 2)) & 3));
+  }
+
+  static int LengthExtra(int code) {
+    return code < 8 || code == 28 ? 0 : code / 4 - 1;
+  }
+
+  static int DistanceCode(size_t distance) {
+    uint32_t value = (uint32_t)(distance - 1);
+    if (value < 4)
+      return (int)value;
+    unsigned bits = FloorLog2(value);
+    return (int)(2 * bits + ((value >> (bits - 1)) & 1));
+  }
+
+  static int DistanceExtra(int code) { return code < 4 ? 0 : code / 2 - 1; }
+
+  static const uint16_t* LengthBase() {
+    static const uint16_t kBase[29] = {
+        3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+        31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    return kBase;
+  }
+
+  static const uint16_t* DistanceBase() {
+    static const uint16_t kBase[30] = {
+        1,    2,    3,    4,    5,    7,    9,    13,    17,    25,
+        33,   49,   65,   97,   129,  193,  257,  385,   513,   769,
+        1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    return kBase;
+  }
+
+  void ResetFrequencies() {
+    memset(literal_freq_, 0, sizeof(literal_freq_));
+    memset(distance_freq_, 0, sizeof(distance_freq_));
+  }
+
+  void EmitLiteral(uint8_t value) {
+    symbols_.push_back({value, 0});
+    ++literal_freq_[value];
+  }
+
+  void EmitMatch(size_t length, size_t distance) {
+    symbols_.push_back({(uint16_t)length, (uint16_t)distance});
+    ++literal_freq_[257 + LengthCode(length)];
+    ++distance_freq_[DistanceCode(distance)];
+  }
+
+  // Code lengths of at most `limit` bits for the frequencies. While the
+  // optimal code is too deep, the frequencies are halved, which flattens it.
+  // One used symbol still gets a second one, as zlib rejects incomplete
+  // codes.
+  static void BuildLengths(const uint32_t* freq,
+                           int n,
+                           int limit,
+                           uint8_t* lengths) {
+    memset(lengths, 0, n);
+    int symbols[kLiteralCodes];
+    int count = 0;
+    for (int i = 0; i < n; ++i) {
+      if (freq[i])
+        symbols[count++] = i;
+    }
+    if (count < 2) {
+      lengths[count ? symbols[0] : 0] = 1;
+      lengths[count && symbols[0] ? 0 : 1] = 1;
+      return;
+    }
+
+    uint32_t scaled[kLiteralCodes];
+    for (int i = 0; i < count; ++i) {
+      scaled[i] = freq[symbols[i]];
+    }
+    for (;;) {
+      int order[kLiteralCodes];
+      for (int i = 0; i < count; ++i) {
+        order[i] = i;
+      }
+      std::sort(order, order + count, [&](int a, int b) {
+        return scaled[a] != scaled[b] ? scaled[a] < scaled[b] : a < b;
+      });
+
+      // Two queues: the sorted leaves and the inner nodes, which are made
+      // in order of weight.
+      uint32_t weight[2 * kLiteralCodes];
+      int parent[2 * kLiteralCodes];
+      for (int i = 0; i < count; ++i) {
+        weight[i] = scaled[order[i]];
+      }
+      int leaf = 0;
+      int inner = count;
+      int next = count;
+      for (int k = 0; k < count - 1; ++k, ++next) {
+        int picked[2];
+        for (int& pick : picked) {
+          if (leaf < count && (inner >= next || weight[leaf] <= weight[inner]))
+            pick = leaf++;
+          else
+            pick = inner++;
+        }
+        weight[next] = weight[picked[0]] + weight[picked[1]];
+        parent[picked[0]] = next;
+        parent[picked[1]] = next;
+      }
+
+      int depth[2 * kLiteralCodes];
+      int root = next - 1;
+      depth[root] = 0;
+      int deepest = 0;
+      for (int i = root - 1; i >= 0; --i) {
+        depth[i] = depth[parent[i]] + 1;
+        deepest = (std::max)(deepest, depth[i]);
+      }
+      if (deepest <= limit) {
+        for (int i = 0; i < count; ++i) {
+          lengths[symbols[order[i]]] = (uint8_t)depth[i];
+        }
+        return;
+      }
+      for (int i = 0; i < count; ++i) {
+        scaled[i] = (scaled[i] >> 1) | 1;
+      }
+    }
+  }
+
+  // Canonical codes for the lengths, bit-reversed for the writer.
+  static void BuildCodes(const uint8_t* lengths, int n, uint16_t* codes) {
+    uint16_t count[16] = {};
+    for (int i = 0; i < n; ++i) {
+      ++count[lengths[i]];
+    }
+    count[0] = 0;
+    uint16_t next[16] = {};
+    uint16_t code = 0;
+    for (int len = 1; len < 16; ++len) {
+      code = (uint16_t)((code + count[len - 1]) << 1);
+      next[len] = code;
+    }
+    for (int i = 0; i < n; ++i) {
+      int len = lengths[i];
+      if (!len)
+        continue;
+      uint16_t value = next[len]++;
+      uint16_t reversed = 0;
+      for (int bit = 0; bit < len; ++bit) {
+        reversed |= ((value >> bit) & 1) << (len - 1 - bit);
+      }
+      codes[i] = reversed;
+    }
+  }
+
+  struct Code {
+    uint8_t lengths[288];
+    uint16_t codes[288];
+  };
+
+  static const Code& FixedLiterals() {
+    static const Code code = [] {
+      Code fixed = {};
+      memset(fixed.lengths, 8, 144);
+      memset(fixed.lengths + 144, 9, 112);
+      memset(fixed.lengths + 256, 7, 24);
+      memset(fixed.lengths + 280, 8, 8);
+      BuildCodes(fixed.lengths, 288, fixed.codes);
+      return fixed;
+    }();
+    return code;
+  }
+
+  static const Code& FixedDistances() {
+    static const Code code = [] {
+      Code fixed = {};
+      memset(fixed.lengths, 5, 30);
+      BuildCodes(fixed.lengths, 30, fixed.codes);
+      return fixed;
+    }();
+    return code;
+  }
+
+  // Bits of the matches' extra fields, the same for every block type.
+  uint64_t ExtraBits() const {
+    uint64_t bits = 0;
+    for (int code = 0; code < 29; ++code) {
+      bits += (uint64_t)literal_freq_[257 + code] * LengthExtra(code);
+    }
+    for (int code = 0; code < kDistanceCodes; ++code) {
+      bits += (uint64_t)distance_freq_[code] * DistanceExtra(code);
+    }
+    return bits;
+  }
+
+  static uint64_t CodeBits(const uint32_t* freq,
+                           const uint8_t* lengths,
+                           int n) {
+    uint64_t bits = 0;
+    for (int i = 0; i < n; ++i) {
+      bits += (uint64_t)freq[i] * lengths[i];
+    }
+    return bits;
+  }
+
+  // Write the block of symbols_ that covers input [start, end).
+  void FlushBlock(size_t start, size_t end, bool final) {
+    literal_freq_[256] = 1;
+    Code literals;
+    Code distances;
+    BuildLengths(literal_freq_, kLiteralCodes, 15, literals.lengths);
+    BuildLengths(distance_freq_, kDistanceCodes, 15, distances.lengths);
+
+    // The code lengths of both codes, run-length coded with 16, 17 and 18.
+    int literal_count = kLiteralCodes;
+    while (literal_count > 257 && !literals.lengths[literal_count - 1]) {
+      --literal_count;
+    }
+    int distance_count = kDistanceCodes;
+    while (distance_count > 1 && !distances.lengths[distance_count - 1]) {
+      --distance_count;
+    }
+    uint8_t all[kLiteralCodes + kDistanceCodes];
+    memcpy(all, literals.lengths, literal_count);
+    memcpy(all + literal_count, distances.lengths, distance_count);
+    int total = literal_count + distance_count;
+
+    struct Run {
+      uint8_t symbol;
+      uint8_t extra;
+    };
+    Run runs[kLiteralCodes + kDistanceCodes];
+    int run_count = 0;
+    uint32_t length_freq[19] = {};
+    for (int i = 0; i < total;) {
+      uint8_t value = all[i];
+      int run = 1;
+      while (i + run < total && all[i + run] == value) {
+        ++run;
+      }
+      i += run;
+      if (value) {
+        runs[run_count++] = {value, 0};
+        --run;
+        while (run >= 3) {
+          int repeat = (std::min)(run, 6);
+          runs[run_count++] = {16, (uint8_t)(repeat - 3)};
+          run -= repeat;
+        }
+      } else {
+        while (run >= 11) {
+          int repeat = (std::min)(run, 138);
+          runs[run_count++] = {18, (uint8_t)(repeat - 11)};
+          run -= repeat;
+        }
+        if (run >= 3) {
+          runs[run_count++] = {17, (uint8_t)(run - 3)};
+          run = 0;
+        }
+      }
+      for (; run > 0; --run) {
+        runs[run_count++] = {value, 0};
+      }
+    }
+    for (int i = 0; i < run_count; ++i) {
+      ++length_freq[runs[i].symbol];
+    }
+
+    static const uint8_t kOrder[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                       11, 4,  12, 3, 13, 2, 14, 1, 15};
+    Code lengths;
+    BuildLengths(length_freq, 19, 7, lengths.lengths);
+    int order_count = 19;
+    while (order_count > 4 && !lengths.lengths[kOrder[order_count - 1]]) {
+      --order_count;
+    }
+
+    uint64_t extra = ExtraBits();
+    uint64_t dynamic_bits =
+        3 + 14 + 3 * order_count + CodeBits(length_freq, lengths.lengths, 19) +
+        2 * length_freq[16] + 3 * length_freq[17] + 7 * length_freq[18] +
+        CodeBits(literal_freq_, literals.lengths, kLiteralCodes) +
+        CodeBits(distance_freq_, distances.lengths, kDistanceCodes) + extra;
+    uint64_t fixed_bits =
+        3 + CodeBits(literal_freq_, FixedLiterals().lengths, kLiteralCodes) +
+        CodeBits(distance_freq_, FixedDistances().lengths, kDistanceCodes) +
+        extra;
+    size_t stored_blocks =
+        (std::max)((size_t)1, (end - start + 0xFFFE) / 0xFFFF);
+    uint64_t stored_bits =
+        (uint64_t)(end - start) * 8 + stored_blocks * 40 + 7;
+
+    if (stored_bits <= dynamic_bits && stored_bits <= fixed_bits) {
+      WriteStored(start, end, final);
+    } else if (fixed_bits <= dynamic_bits) {
+      writer_.Put(final ? 1 : 0, 1);
+      writer_.Put(1, 2);
+      WriteSymbols(FixedLiterals(), FixedDistances());
+    } else {
+      BuildCodes(literals.lengths, kLiteralCodes, literals.codes);
+      BuildCodes(distances.lengths, kDistanceCodes, distances.codes);
+      BuildCodes(lengths.lengths, 19, lengths.codes);
+      writer_.Put(final ? 1 : 0, 1);
+      writer_.Put(2, 2);
+      writer_.Put(literal_count - 257, 5);
+      writer_.Put(distance_count - 1, 5);
+      writer_.Put(order_count - 4, 4);
+      for (int i = 0; i < order_count; ++i) {
+        writer_.Put(lengths.lengths[kOrder[i]], 3);
+      }
+      static const int kRunExtra[3] = {2, 3, 7};
+      for (int i = 0; i < run_count; ++i) {
+        uint8_t symbol = runs[i].symbol;
+        writer_.Put(lengths.codes[symbol], lengths.lengths[symbol]);
+        if (symbol >= 16)
+          writer_.Put(runs[i].extra, kRunExtra[symbol - 16]);
+      }
+      WriteSymbols(literals, distances);
+    }
+
+    symbols_.clear();
+    ResetFrequencies();
+  }
+
+  void WriteStored(size_t start, size_t end, bool final) {
+    do {
+      uint16_t length = (uint16_t)(std::min)(end - start, (size_t)0xFFFF);
+      writer_.Put(final && start + length == end ? 1 : 0, 1);
+      writer_.Put(0, 2);
+      writer_.Align();
+      writer_.Put(length, 16);
+      writer_.Put((uint16_t)~length, 16);
+      writer_.Align();
+      writer_.PutBytes(base_ + start, length);
+      start += length;
+    } while (start < end);
+  }
+
+  void WriteSymbols(const Code& literals, const Code& distances) {
+    const uint16_t* length_base = LengthBase();
+    const uint16_t* distance_base = DistanceBase();
+    for (const Symbol& symbol : symbols_) {
+      if (!symbol.distance) {
+        writer_.Put(literals.codes[symbol.length],
+                    literals.lengths[symbol.length]);
+        continue;
+      }
+      int code = LengthCode(symbol.length);
+      writer_.Put(literals.codes[257 + code], literals.lengths[257 + code]);
+      writer_.Put(symbol.length - length_base[code], LengthExtra(code));
+      code = DistanceCode(symbol.distance);
+      writer_.Put(distances.codes[code], distances.lengths[code]);
+      writer_.Put(symbol.distance - distance_base[code], DistanceExtra(code));
+    }
+    writer_.Put(literals.codes[256], literals.lengths[256]);
+  }
+
+  std::vector<int32_t> head_;
+  std::vector<int32_t> prev_;
+  std::vector<Symbol> symbols_;
+  uint32_t literal_freq_[kLiteralCodes];
+  uint32_t distance_freq_[kDistanceCodes];
+
+  const uint8_t* base_ = nullptr;
+  size_t end_ = 0;
+  BitWriter writer_;
+
+  int chain_ = 1;
+  bool lazy_ = false;
+  size_t nice_ = kMaxMatch;
+  size_t max_insert_ = kMaxMatch;
+};
+
+#endif  // DEFLATE_H_
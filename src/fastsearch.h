@@ -1,62 +1,319 @@
 #ifndef FASTSEARCH_H_
 #define FASTSEARCH_H_
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
-static const uint8_t* ForceSearch(const uint8_t* s, int n, const uint8_t* p) {
-  int i;
-  for (i = 0; i < n; ++i) {
-    if (*(s + i) == *p) {
-      return s + i;
-    }
-  }
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+#define FASTSEARCH_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
 
-  return nullptr;
-}
+// MSVC allows intrinsics of any instruction set in any function, GCC and
+// Clang need the target to be enabled per function.
+#if defined(FASTSEARCH_X86) && !defined(_MSC_VER)
+#define FASTSEARCH_TARGET_SSE2 __attribute__((target("sse2")))
+#define FASTSEARCH_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define FASTSEARCH_TARGET_SSE2
+#define FASTSEARCH_TARGET_AVX2
+#endif
 
-static const uint8_t* SundaySearch(const uint8_t* s,
-                                   int n,
+// Crochemore-Perrin Two-Way search, O(n + m) time in the worst case.
+// Only the bytes that occur in the needle get a shift entry, so there is no
+// 256-entry table to initialize per call.
+static const uint8_t* TwoWaySearch(const uint8_t* s,
+                                   size_t n,
                                    const uint8_t* p,
-                                   int m) {
-  int i, j;
+                                   size_t m) {
+  if (n < m)
+    return nullptr;
+  if (m == 0)
+    return s;
+
+  uint32_t byteset[256 / 32] = {0};
+  uint32_t shift[256];
+  for (size_t i = 0; i < m; ++i) {
+    byteset[p[i] >> 5] |= 1u << (p[i] & 31);
+    shift[p[i]] = (uint32_t)(i + 1);
+  }
 
-  size_t skip[256];
+  // Compute the maximal suffix for both orderings, the critical
+  // factorization is the longer one of the two.
+  size_t ip = (size_t)-1, jp = 0, k = 1, period = 1;
+  while (jp + k < m) {
+    if (p[ip + k] == p[jp + k]) {
+      if (k == period) {
+        jp += period;
+        k = 1;
+      } else {
+        ++k;
+      }
+    } else if (p[ip + k] > p[jp + k]) {
+      jp += k;
+      k = 1;
+      period = jp - ip;
+    } else {
+      ip = jp++;
+      k = period = 1;
+    }
+  }
+  size_t ms = ip;
+  size_t period0 = period;
 
-  for (i = 0; i < 256; ++i) {
-    skip[i] = m + 1;
+  ip = (size_t)-1, jp = 0, k = 1, period = 1;
+  while (jp + k < m) {
+    if (p[ip + k] == p[jp + k]) {
+      if (k == period) {
+        jp += period;
+        k = 1;
+      } else {
+        ++k;
+      }
+    } else if (p[ip + k] < p[jp + k]) {
+      jp += k;
+      k = 1;
+      period = jp - ip;
+    } else {
+      ip = jp++;
+      k = period = 1;
+    }
   }
+  if (ip + 1 > ms + 1)
+    ms = ip;
+  else
+    period = period0;
 
-  for (i = 0; i < m; ++i) {
-    skip[p[i]] = m - i;
+  // A periodic needle remembers how much of the left half already matched.
+  size_t mem0;
+  if (memcmp(p, p + period, ms + 1) != 0) {
+    mem0 = 0;
+    period = (ms > m - ms - 1 ? ms : m - ms - 1) + 1;
+  } else {
+    mem0 = m - period;
   }
 
-  i = 0;
-  while (i <= n - m) {
-    j = 0;
-    while (s[i + j] == p[j]) {
-      ++j;
-      if (j >= m) {
-        return s + i;
+  const uint8_t* end = s + n;
+  size_t mem = 0;
+  for (;;) {
+    if ((size_t)(end - s) < m)
+      return nullptr;
+
+    // Check the last byte first and skip on a mismatch.
+    uint8_t c = s[m - 1];
+    if (byteset[c >> 5] & (1u << (c & 31))) {
+      k = m - shift[c];
+      if (k) {
+        if (k < mem)
+          k = mem;
+        s += k;
+        mem = 0;
+        continue;
       }
+    } else {
+      s += m;
+      mem = 0;
+      continue;
+    }
+
+    // Compare the right half.
+    for (k = (ms + 1 > mem ? ms + 1 : mem); k < m && p[k] == s[k]; ++k) {
+    }
+    if (k < m) {
+      s += k - ms;
+      mem = 0;
+      continue;
     }
 
-    i += (int)skip[s[i + m]];
+    // Compare the left half.
+    for (k = ms + 1; k > mem && p[k - 1] == s[k - 1]; --k) {
+    }
+    if (k <= mem)
+      return s;
+    s += period;
+    mem = mem0;
   }
+}
 
-  return nullptr;
+#ifdef FASTSEARCH_X86
+static inline unsigned CountTrailingZeros(uint32_t mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return index;
+#else
+  return __builtin_ctz(mask);
+#endif
 }
 
-const uint8_t* FastSearch(const uint8_t* s, int n, const uint8_t* p, int m) {
+// The SIMD kernels compare the first and the last needle byte against a
+// whole block of candidate positions and only run memcmp for positions where
+// both match. Repetitive data (zero padding, int3 runs) can make nearly every
+// position a candidate, so the verification work is budgeted and the rest of
+// the haystack is handed to Two-Way once the budget is exceeded. This keeps
+// the worst case linear.
+static inline bool SimdVerifyBudgetExceeded(size_t verified, size_t scanned) {
+  return verified > 4 * scanned + 4096;
+}
+
+FASTSEARCH_TARGET_SSE2
+static const uint8_t* Sse2Search(const uint8_t* s,
+                                 size_t n,
+                                 const uint8_t* p,
+                                 size_t m) {
+  const __m128i first = _mm_set1_epi8((char)p[0]);
+  const __m128i last = _mm_set1_epi8((char)p[m - 1]);
+
+  size_t verified = 0;
+  size_t i = 0;
+  for (; i + m + 15 <= n; i += 16) {
+    const __m128i block_first = _mm_loadu_si128((const __m128i*)(s + i));
+    const __m128i block_last =
+        _mm_loadu_si128((const __m128i*)(s + i + m - 1));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                      _mm_cmpeq_epi8(last, block_last)));
+    while (mask) {
+      unsigned bit = CountTrailingZeros(mask);
+      if (memcmp(s + i + bit + 1, p + 1, m - 2) == 0)
+        return s + i + bit;
+      verified += m;
+      mask &= mask - 1;
+    }
+    if (SimdVerifyBudgetExceeded(verified, i))
+      break;
+  }
+
+  return TwoWaySearch(s + i, n - i, p, m);
+}
+
+FASTSEARCH_TARGET_AVX2
+static const uint8_t* Avx2Search(const uint8_t* s,
+                                 size_t n,
+                                 const uint8_t* p,
+                                 size_t m) {
+  const __m256i first = _mm256_set1_epi8((char)p[0]);
+  const __m256i last = _mm256_set1_epi8((char)p[m - 1]);
+
+  size_t verified = 0;
+  size_t i = 0;
+  for (; i + m + 31 <= n; i += 32) {
+    const __m256i block_first = _mm256_loadu_si256((const __m256i*)(s + i));
+    const __m256i block_last =
+        _mm256_loadu_si256((const __m256i*)(s + i + m - 1));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                         _mm256_cmpeq_epi8(last, block_last)));
+    while (mask) {
+      unsigned bit = CountTrailingZeros(mask);
+      if (memcmp(s + i + bit + 1, p + 1, m - 2) == 0)
+        return s + i + bit;
+      verified += m;
+      mask &= mask - 1;
+    }
+    if (SimdVerifyBudgetExceeded(verified, i))
+      break;
+  }
+
+  return TwoWaySearch(s + i, n - i, p, m);
+}
+
+static bool CpuSupportsSse2() {
+#if defined(_M_X64) || defined(__x86_64__)
+  return true;
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[3] & (1 << 26)) != 0;
+#else
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (edx & (1u << 26)) != 0;
+#endif
+}
+
+static bool CpuSupportsAvx2() {
+  // The OS must also save the YMM registers on context switches.
+  const unsigned kOsxsave = 1u << 27;
+  const unsigned kAvx = 1u << 28;
+  const unsigned kAvx2 = 1u << 5;
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7)
+    return false;
+  __cpuid(info, 1);
+  if ((info[2] & kOsxsave) == 0 || (info[2] & kAvx) == 0)
+    return false;
+  if ((_xgetbv(0) & 0x6) != 0x6)
+    return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] & kAvx2) != 0;
+#else
+  unsigned eax, ebx, ecx, edx;
+  if (__get_cpuid_max(0, nullptr) < 7)
+    return false;
+  __cpuid(1, eax, ebx, ecx, edx);
+  if ((ecx & kOsxsave) == 0 || (ecx & kAvx) == 0)
+    return false;
+  uint32_t xcr0_lo, xcr0_hi;
+  __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  if ((xcr0_lo & 0x6) != 0x6)
+    return false;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return (ebx & kAvx2) != 0;
+#endif
+}
+#endif  // FASTSEARCH_X86
+
+typedef const uint8_t* (*SearchKernel)(const uint8_t* s,
+                                       size_t n,
+                                       const uint8_t* p,
+                                       size_t m);
+
+// Pick the widest kernel the CPU supports, once per process.
+static SearchKernel GetSearchKernel() {
+  static const SearchKernel kernel = []() -> SearchKernel {
+#ifdef FASTSEARCH_X86
+    if (CpuSupportsAvx2())
+      return Avx2Search;
+    if (CpuSupportsSse2())
+      return Sse2Search;
+#endif
+    return TwoWaySearch;
+  }();
+  return kernel;
+}
+
+static const uint8_t* SearchBytes(const uint8_t* s,
+                                  size_t n,
+                                  const uint8_t* p,
+                                  size_t m) {
   if (!s || !p || n < m)
     return nullptr;
 
   if (m == 0) {
     return s;
   } else if (m == 1) {
-    return ForceSearch(s, n, p);
+    return (const uint8_t*)memchr(s, *p, n);
   }
 
-  return SundaySearch(s, n, p, m);
+  return GetSearchKernel()(s, n, p, m);
+}
+
+const uint8_t* FastSearch(const uint8_t* s, int n, const uint8_t* p, int m) {
+  if (n < 0 || m < 0)
+    return nullptr;
+
+  return SearchBytes(s, (size_t)n, p, (size_t)m);
 }
 
 #endif  // FASTSEARCH_H_
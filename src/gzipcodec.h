@@ -0,0 +1,74 @@
+#ifndef GZIPCODEC_H_
+#define GZIPCODEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "crc32.h"
+#include "deflate.h"
+#include "inflate.h"
+
+// The raw deflate and CRC-32 of a gzip member, as pak patching uses them.
+// A codec keeps state between calls and belongs to one thread.
+class GzipCodec {
+ public:
+  virtual ~GzipCodec() {}
+
+  virtual const char* name() const = 0;
+
+  // Inflate [in, in + in_size) into exactly `out_size` bytes at `out`. Where
+  // the blocks start goes into `blocks`, which stays empty if the codec
+  // cannot tell.
+  virtual bool Inflate(const uint8_t* in,
+                       size_t in_size,
+                       uint8_t* out,
+                       size_t out_size,
+                       std::vector<DeflateBlock>* blocks) = 0;
+
+  // Deflate `size` bytes at `data` into at most `capacity` bytes at `out` at
+  // `level` 1 to 9, letting matches reach back into the `primed` bytes
+  // before `data`. Returns the compressed size, 0 if it does not fit.
+  virtual size_t Deflate(const uint8_t* data,
+                         size_t size,
+                         size_t primed,
+                         int level,
+                         uint8_t* out,
+                         size_t capacity) = 0;
+
+  virtual uint32_t Crc32(uint32_t crc, const uint8_t* data, size_t size) = 0;
+};
+
+// BlockInflater, FastDeflater and the hardware CRC-32.
+class FastGzipCodec : public GzipCodec {
+ public:
+  const char* name() const override { return "fast"; }
+
+  bool Inflate(const uint8_t* in,
+               size_t in_size,
+               uint8_t* out,
+               size_t out_size,
+               std::vector<DeflateBlock>* blocks) override {
+    return inflater_.Inflate(in, in_size, out, out_size, blocks);
+  }
+
+  size_t Deflate(const uint8_t* data,
+                 size_t size,
+                 size_t primed,
+                 int level,
+                 uint8_t* out,
+                 size_t capacity) override {
+    return deflater_.Compress(data, size, primed, level, out, capacity);
+  }
+
+  uint32_t Crc32(uint32_t crc, const uint8_t* data, size_t size) override {
+    return ::Crc32(crc, data, size);
+  }
+
+ private:
+  BlockInflater inflater_;
+  FastDeflater deflater_;
+};
+
+#endif  // GZIPCODEC_H_
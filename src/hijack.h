@@ -5,6 +5,8 @@
 #include <stdint.h>
 #include <windows.h>
 
+#include "peimage.h"
+
 namespace hijack {
 
 #define NOP_FUNC        \
@@ -101,36 +103,23 @@ void InstallDetours(PBYTE pTarget, PBYTE pDetour) {
 
 #pragma region Load system dll
 void LoadVersion(HINSTANCE hModule) {
-  PBYTE pImageBase = (PBYTE)hModule;
-  PIMAGE_DOS_HEADER pimDH = (PIMAGE_DOS_HEADER)pImageBase;
-  if (pimDH->e_magic == IMAGE_DOS_SIGNATURE) {
-    PIMAGE_NT_HEADERS pimNH = (PIMAGE_NT_HEADERS)(pImageBase + pimDH->e_lfanew);
-    if (pimNH->Signature == IMAGE_NT_SIGNATURE) {
-      PIMAGE_EXPORT_DIRECTORY pimExD =
-          (PIMAGE_EXPORT_DIRECTORY)(pImageBase +
-                                    pimNH->OptionalHeader
-                                        .DataDirectory
-                                            [IMAGE_DIRECTORY_ENTRY_EXPORT]
-                                        .VirtualAddress);
-      DWORD* pName = (DWORD*)(pImageBase + pimExD->AddressOfNames);
-      DWORD* pFunction = (DWORD*)(pImageBase + pimExD->AddressOfFunctions);
-      WORD* pNameOrdinals = (WORD*)(pImageBase + pimExD->AddressOfNameOrdinals);
+  const PeImage& image = GetModuleImage(hModule);
+  if (!image.valid())
+    return;
 
-      wchar_t szSysDirectory[MAX_PATH + 1];
-      GetSystemDirectory(szSysDirectory, MAX_PATH);
+  wchar_t szSysDirectory[MAX_PATH + 1];
+  GetSystemDirectory(szSysDirectory, MAX_PATH);
 
-      wchar_t szDLLPath[MAX_PATH + 1];
-      lstrcpy(szDLLPath, szSysDirectory);
-      lstrcat(szDLLPath, TEXT("\\version.dll"));
+  wchar_t szDLLPath[MAX_PATH + 1];
+  lstrcpy(szDLLPath, szSysDirectory);
+  lstrcat(szDLLPath, TEXT("\\version.dll"));
 
-      HINSTANCE module = LoadLibrary(szDLLPath);
-      for (size_t i = 0; i < pimExD->NumberOfNames; ++i) {
-        PBYTE Original =
-            (PBYTE)GetProcAddress(module, (char*)(pImageBase + pName[i]));
-        if (Original) {
-          InstallDetours(pImageBase + pFunction[pNameOrdinals[i]], Original);
-        }
-      }
+  HINSTANCE module = LoadLibrary(szDLLPath);
+  for (const auto& function : image.exports()) {
+    PBYTE Original = (PBYTE)GetProcAddress(module, function.name);
+    PBYTE Target = (PBYTE)image.RvaToPointer(function.rva);
+    if (Original && Target && !function.forwarded) {
+      InstallDetours(Target, Original);
     }
   }
 }
@@ -358,8 +358,7 @@ bool IsNameNewTab(NodePtr top) {
     return false;
   }
 
-  std::vector<std::wstring> disable_tab_names =
-      StringSplit(GetDisableTabName(), L',', L"\"");
+  const auto& disable_tab_names = GetDisableTabNames();
   TraversalAccessible(
       page_tab_pane, [&flag, &new_tab_name, &disable_tab_names](NodePtr child) {
         if (GetAccessibleState(child) & STATE_SYSTEM_SELECTED) {
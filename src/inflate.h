@@ -0,0 +1,342 @@
+#ifndef INFLATE_H_
+#define INFLATE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+// Where a deflate block starts: the first bit of its header in the compressed
+// data and the first byte it inflates to.
+struct DeflateBlock {
+  size_t bit_offset;
+  size_t output_offset;
+};
+
+// A raw deflate (RFC 1951) decoder that also reports where each block starts,
+// which tinfl keeps to itself. Everything up to a block start can be reused
+// bit for bit by a compressor that continues from there.
+//
+// Huffman codes up to kFastBits long are decoded with one table lookup,
+// longer ones canonically a bit at a time as in zlib's puff. The input is
+// read a word at a time and matches are copied 8 bytes at a time.
+class BlockInflater {
+ public:
+  // Inflate [in, in + in_size) into exactly `out_size` bytes at `out` and
+  // list the blocks in `blocks`. Returns false if the data is malformed or
+  // does not inflate to `out_size` bytes.
+  bool Inflate(const uint8_t* in,
+               size_t in_size,
+               uint8_t* out,
+               size_t out_size,
+               std::vector<DeflateBlock>* blocks) {
+    in_ = in;
+    in_size_ = in_size;
+    in_pos_ = 0;
+    bits_ = 0;
+    bit_count_ = 0;
+    out_ = out;
+    out_size_ = out_size;
+    out_pos_ = 0;
+    blocks->clear();
+
+    bool final = false;
+    while (!final) {
+      blocks->push_back({position(), out_pos_});
+      final = Bits(1) != 0;
+      bool ok = false;
+      switch (Bits(2)) {
+        case 0:
+          ok = Stored();
+          break;
+        case 1:
+          BuildFixed();
+          ok = Codes(fixed_literals_, fixed_distances_);
+          break;
+        case 2:
+          ok = Dynamic() && Codes(literals_, distances_);
+          break;
+        default:
+          break;
+      }
+      if (!ok || position() > in_size_ * 8)
+        return false;
+    }
+    return out_pos_ == out_size_;
+  }
+
+ private:
+  static constexpr int kFastBits = 10;
+  static constexpr int kMaxBits = 15;
+
+  struct Huffman {
+    // symbol << 4 | length for codes of up to kFastBits, 0 for longer ones.
+    uint16_t fast[1 << kFastBits];
+    uint16_t count[kMaxBits + 1];
+    uint16_t symbol[288];
+  };
+
+  // Bits consumed so far. Reads past the end see zeros and are caught by
+  // comparing this with the input size.
+  size_t position() const { return in_pos_ * 8 - bit_count_; }
+
+  void Refill() {
+    if (in_pos_ + 8 <= in_size_) {
+      // Load a whole word and keep the bytes that fit. The bits above
+      // bit_count_ are the next bytes, which the next load ORs in again.
+      uint64_t word;
+      memcpy(&word, in_ + in_pos_, 8);
+      bits_ |= word << bit_count_;
+      in_pos_ += (63 - bit_count_) >> 3;
+      bit_count_ |= 56;
+      return;
+    }
+    while (bit_count_ <= 56) {
+      if (in_pos_ < in_size_)
+        bits_ |= (uint64_t)in_[in_pos_] << bit_count_;
+      ++in_pos_;
+      bit_count_ += 8;
+    }
+  }
+
+  uint32_t Bits(int count) {
+    if (bit_count_ < count)
+      Refill();
+    uint32_t value = (uint32_t)(bits_ & ((1ull << count) - 1));
+    bits_ >>= count;
+    bit_count_ -= count;
+    return value;
+  }
+
+  // Build the decoding tables from the code lengths, false if the lengths
+  // are over-subscribed. Incomplete codes are allowed; their unused codes
+  // fail to decode.
+  static bool Build(Huffman* h, const uint8_t* lengths, int n) {
+    memset(h->count, 0, sizeof(h->count));
+    for (int i = 0; i < n; ++i) {
+      ++h->count[lengths[i]];
+    }
+    int left = 1;
+    for (int len = 1; len <= kMaxBits; ++len) {
+      left = (left << 1) - h->count[len];
+      if (left < 0)
+        return false;
+    }
+
+    uint16_t offsets[kMaxBits + 2];
+    offsets[1] = 0;
+    for (int len = 1; len <= kMaxBits; ++len) {
+      offsets[len + 1] = offsets[len] + h->count[len];
+    }
+    for (int i = 0; i < n; ++i) {
+      if (lengths[i])
+        h->symbol[offsets[lengths[i]]++] = (uint16_t)i;
+    }
+
+    memset(h->fast, 0, sizeof(h->fast));
+    uint32_t code = 0;
+    size_t index = 0;
+    for (int len = 1; len <= kFastBits; ++len) {
+      for (int i = 0; i < h->count[len]; ++i, ++code, ++index) {
+        // Codes are sent most significant bit first.
+        uint32_t reversed = 0;
+        for (int bit = 0; bit < len; ++bit) {
+          reversed |= ((code >> bit) & 1) << (len - 1 - bit);
+        }
+        for (uint32_t fill = reversed; fill < (1u << kFastBits);
+             fill += 1u << len) {
+          h->fast[fill] = (uint16_t)(h->symbol[index] << 4 | len);
+        }
+      }
+      code <<= 1;
+    }
+    return true;
+  }
+
+  // The next symbol, -1 if the bits are not a code.
+  int Decode(const Huffman& h) {
+    if (bit_count_ < kMaxBits)
+      Refill();
+    uint16_t entry = h.fast[bits_ & ((1u << kFastBits) - 1)];
+    if (entry) {
+      bits_ >>= entry & 15;
+      bit_count_ -= entry & 15;
+      return entry >> 4;
+    }
+
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for (int len = 1; len <= kMaxBits; ++len) {
+      code |= (int)Bits(1);
+      int count = h.count[len];
+      if (code - count < first)
+        return h.symbol[index + (code - first)];
+      index += count;
+      first = (first + count) << 1;
+      code <<= 1;
+    }
+    return -1;
+  }
+
+  bool Stored() {
+    // Skip to the byte boundary and read from the input directly.
+    Bits(bit_count_ % 8);
+    in_pos_ -= bit_count_ / 8;
+    bits_ = 0;
+    bit_count_ = 0;
+    if (in_pos_ + 4 > in_size_)
+      return false;
+    size_t length = in_[in_pos_] | (in_[in_pos_ + 1] << 8);
+    size_t inverted = in_[in_pos_ + 2] | (in_[in_pos_ + 3] << 8);
+    in_pos_ += 4;
+    if (length != (~inverted & 0xFFFF) || length > in_size_ - in_pos_ ||
+        length > out_size_ - out_pos_) {
+      return false;
+    }
+    memcpy(out_ + out_pos_, in_ + in_pos_, length);
+    in_pos_ += length;
+    out_pos_ += length;
+    return true;
+  }
+
+  void BuildFixed() {
+    if (fixed_built_)
+      return;
+    uint8_t lengths[288];
+    memset(lengths, 8, 144);
+    memset(lengths + 144, 9, 112);
+    memset(lengths + 256, 7, 24);
+    memset(lengths + 280, 8, 8);
+    Build(&fixed_literals_, lengths, 288);
+    memset(lengths, 5, 30);
+    Build(&fixed_distances_, lengths, 30);
+    fixed_built_ = true;
+  }
+
+  bool Dynamic() {
+    static const uint8_t kOrder[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                       11, 4,  12, 3, 13, 2, 14, 1, 15};
+    int literal_count = (int)Bits(5) + 257;
+    int distance_count = (int)Bits(5) + 1;
+    int length_count = (int)Bits(4) + 4;
+    if (literal_count > 286 || distance_count > 30)
+      return false;
+
+    uint8_t lengths[286 + 30] = {};
+    for (int i = 0; i < length_count; ++i) {
+      lengths[kOrder[i]] = (uint8_t)Bits(3);
+    }
+    Huffman& lengths_code = literals_;
+    if (!Build(&lengths_code, lengths, 19))
+      return false;
+
+    int total = literal_count + distance_count;
+    for (int i = 0; i < total;) {
+      int symbol = Decode(lengths_code);
+      if (symbol < 0)
+        return false;
+      if (symbol < 16) {
+        lengths[i++] = (uint8_t)symbol;
+        continue;
+      }
+      uint8_t value = 0;
+      int repeat;
+      if (symbol == 16) {
+        if (!i)
+          return false;
+        value = lengths[i - 1];
+        repeat = 3 + (int)Bits(2);
+      } else if (symbol == 17) {
+        repeat = 3 + (int)Bits(3);
+      } else {
+        repeat = 11 + (int)Bits(7);
+      }
+      if (i + repeat > total)
+        return false;
+      memset(lengths + i, value, repeat);
+      i += repeat;
+    }
+
+    // A block without an end-of-block code could never end.
+    if (!lengths[256])
+      return false;
+    return Build(&literals_, lengths, literal_count) &&
+           Build(&distances_, lengths + literal_count, distance_count);
+  }
+
+  bool Codes(const Huffman& literals, const Huffman& distances) {
+    static const uint16_t kLengthBase[29] = {
+        3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+        31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const uint8_t kLengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                             1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                             4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const uint16_t kDistanceBase[30] = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+        1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+    static const uint8_t kDistanceExtra[30] = {0, 0, 0,  0,  1,  1,  2,  2,
+                                               3, 3, 4,  4,  5,  5,  6,  6,
+                                               7, 7, 8,  8,  9,  9,  10, 10,
+                                               11, 11, 12, 12, 13, 13};
+    for (;;) {
+      int symbol = Decode(literals);
+      if (symbol < 0)
+        return false;
+      if (symbol < 256) {
+        if (out_pos_ == out_size_)
+          return false;
+        out_[out_pos_++] = (uint8_t)symbol;
+        continue;
+      }
+      if (symbol == 256)
+        return position() <= in_size_ * 8;
+
+      symbol -= 257;
+      if (symbol >= 29)
+        return false;
+      size_t length = kLengthBase[symbol] + Bits(kLengthExtra[symbol]);
+      symbol = Decode(distances);
+      if (symbol < 0 || symbol >= 30)
+        return false;
+      size_t distance = kDistanceBase[symbol] + Bits(kDistanceExtra[symbol]);
+      if (distance > out_pos_ || length > out_size_ - out_pos_)
+        return false;
+
+      // Matches may overlap their own output. From 8 bytes back, copying 8
+      // at a time forwards is still exact; it may write up to 7 bytes past
+      // the match, which the next symbols overwrite.
+      uint8_t* to = out_ + out_pos_;
+      const uint8_t* from = to - distance;
+      if (distance >= 8 && out_size_ - out_pos_ >= length + 8) {
+        for (size_t i = 0; i < length; i += 8) {
+          memcpy(to + i, from + i, 8);
+        }
+      } else {
+        for (size_t i = 0; i < length; ++i) {
+          to[i] = from[i];
+        }
+      }
+      out_pos_ += length;
+    }
+  }
+
+  const uint8_t* in_ = nullptr;
+  size_t in_size_ = 0;
+  size_t in_pos_ = 0;
+  uint64_t bits_ = 0;
+  int bit_count_ = 0;
+  uint8_t* out_ = nullptr;
+  size_t out_size_ = 0;
+  size_t out_pos_ = 0;
+
+  Huffman literals_;
+  Huffman distances_;
+  Huffman fixed_literals_;
+  Huffman fixed_distances_;
+  bool fixed_built_ = false;
+};
+
+#endif  // INFLATE_H_
@@ -0,0 +1,199 @@
+#ifndef MULTISEARCH_H_
+#define MULTISEARCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "parallel.h"
+#include "signature.h"
+
+// Finds every match of a set of signatures in one pass over the data.
+//
+// Each signature is keyed by two adjacent fixed bytes taken from its anchor
+// run. The scan tests every position against a 64K-bit filter of those keys
+// (8 KB, stays in L1) and only looks up and verifies the signatures of keys
+// that pass. Adding signatures therefore costs a few more filter bits instead
+// of another pass over the section.
+class MultiPatternScanner {
+ public:
+  // Register a signature, returns its index for matches(). The pattern bytes
+  // must outlive the scanner.
+  size_t Add(const PatternView& pattern) {
+    size_t index = patterns_.size();
+    patterns_.push_back(pattern);
+    matches_.emplace_back();
+    keyed_ = false;
+    return index;
+  }
+
+  template <size_t N>
+  size_t Add(const BytePattern<N>& pattern) {
+    return Add(pattern.view());
+  }
+
+  size_t size() const { return patterns_.size(); }
+
+  // Scan [s, s + n) and append the matches of every signature in address
+  // order. Scanning several sections appends to the same results.
+  void Scan(const uint8_t* s, size_t n) {
+    if (!s)
+      return;
+    BuildKeys();
+    ScanRange(s, n, 0, n, matches_);
+  }
+
+  // Scan() on up to `workers` threads, with the same results. The data is
+  // split into the chunks of ParallelChunkSearch, each collects the matches
+  // that start in it, and those are appended in chunk order.
+  void ParallelScan(const uint8_t* s,
+                    size_t n,
+                    size_t workers = DefaultWorkerCount()) {
+    if (!s)
+      return;
+    BuildKeys();
+
+    size_t chunks = (n + kSearchChunkSize - 1) / kSearchChunkSize;
+    if (workers <= 1 || n < kParallelSearchThreshold || chunks < 2) {
+      ScanRange(s, n, 0, n, matches_);
+      return;
+    }
+    std::vector<Matches> found(chunks, Matches(patterns_.size()));
+    ParallelFor(chunks, workers, [&](size_t chunk) {
+      size_t begin = chunk * kSearchChunkSize;
+      ScanRange(s, n, begin, (std::min)(n, begin + kSearchChunkSize),
+                found[chunk]);
+    });
+    for (const Matches& chunk : found) {
+      for (size_t index = 0; index < patterns_.size(); ++index) {
+        matches_[index].insert(matches_[index].end(), chunk[index].begin(),
+                               chunk[index].end());
+      }
+    }
+  }
+
+  // Every match of signature `index` found by Scan() so far.
+  const std::vector<const uint8_t*>& matches(size_t index) const {
+    return matches_[index];
+  }
+
+  const uint8_t* first_match(size_t index) const {
+    return matches_[index].empty() ? nullptr : matches_[index].front();
+  }
+
+  void ClearMatches() {
+    for (auto& match : matches_)
+      match.clear();
+  }
+
+ private:
+  using Matches = std::vector<std::vector<const uint8_t*>>;
+
+  struct Key {
+    uint16_t key;
+    uint32_t offset;
+    uint32_t index;
+  };
+
+  // Append the matches in [s, s + n) that start in [begin, end) to `out`.
+  // Signatures may run past `end`, but not past n.
+  void ScanRange(const uint8_t* s,
+                 size_t n,
+                 size_t begin,
+                 size_t end,
+                 Matches& out) const {
+    if (!keys_.empty() && n >= 2) {
+      for (size_t pos = begin; pos + 1 < n && pos < end + max_offset_; ++pos) {
+        uint16_t key = (uint16_t)(s[pos] | (s[pos + 1] << 8));
+        if (!(filter_[key >> 6] & (1ull << (key & 63))))
+          continue;
+
+        auto range = std::equal_range(
+            keys_.begin(), keys_.end(), Key{key, 0, 0},
+            [](const Key& a, const Key& b) { return a.key < b.key; });
+        for (auto it = range.first; it != range.second; ++it) {
+          if (pos < begin + it->offset || pos - it->offset >= end)
+            continue;
+          size_t start = pos - it->offset;
+          const PatternView& pattern = patterns_[it->index];
+          if (start + pattern.size <= n && MatchPattern(s + start, pattern))
+            out[it->index].push_back(s + start);
+        }
+      }
+    }
+
+    // Signatures with fewer than two fixed bytes in a row can't be keyed.
+    for (size_t index : unkeyed_) {
+      const PatternView& pattern = patterns_[index];
+      const uint8_t* pos = s + begin;
+      const uint8_t* limit = s + (std::min)(n, end + pattern.size - 1);
+      while (const uint8_t* hit = PatternSearch(pos, limit - pos, pattern)) {
+        out[index].push_back(hit);
+        pos = hit + 1;
+      }
+    }
+  }
+
+  // Bytes that are everywhere in x86 code and padding make poor keys.
+  static int ByteRarity(uint8_t c) {
+    static const uint8_t kCommon[] = {0x00, 0x01, 0x0F, 0x24, 0x48, 0x4C,
+                                      0x74, 0x75, 0x83, 0x85, 0x89, 0x8B,
+                                      0x8D, 0x90, 0xC3, 0xCC, 0xE8, 0xFF};
+    return memchr(kCommon, c, sizeof(kCommon)) ? 0 : 1;
+  }
+
+  void BuildKeys() {
+    if (keyed_)
+      return;
+    keyed_ = true;
+
+    keys_.clear();
+    unkeyed_.clear();
+    max_offset_ = 0;
+    memset(filter_, 0, sizeof(filter_));
+    for (size_t index = 0; index < patterns_.size(); ++index) {
+      const PatternView& pattern = patterns_[index];
+      if (pattern.anchor_size < 2) {
+        unkeyed_.push_back(index);
+        continue;
+      }
+
+      // Take the rarest byte pair of the anchor run.
+      size_t best = pattern.anchor;
+      int best_score = -1;
+      for (size_t i = pattern.anchor;
+           i + 1 < pattern.anchor + pattern.anchor_size; ++i) {
+        int score =
+            ByteRarity(pattern.value[i]) + ByteRarity(pattern.value[i + 1]);
+        if (score > best_score) {
+          best_score = score;
+          best = i;
+        }
+      }
+
+      uint16_t key =
+          (uint16_t)(pattern.value[best] | (pattern.value[best + 1] << 8));
+      keys_.push_back({key, (uint32_t)best, (uint32_t)index});
+      max_offset_ = (std::max)(max_offset_, best);
+      filter_[key >> 6] |= 1ull << (key & 63);
+    }
+    std::sort(keys_.begin(), keys_.end(), [](const Key& a, const Key& b) {
+      return a.key < b.key || (a.key == b.key && a.index < b.index);
+    });
+  }
+
+  std::vector<PatternView> patterns_;
+  std::vector<std::vector<const uint8_t*>> matches_;
+
+  bool keyed_ = false;
+  std::vector<Key> keys_;
+  std::vector<size_t> unkeyed_;
+  // The largest offset of a key in its signature.
+  size_t max_offset_ = 0;
+  uint64_t filter_[65536 / 64];
+};
+
+#endif  // MULTISEARCH_H_
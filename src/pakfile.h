@@ -1,16 +1,36 @@
 ﻿#ifndef PAKFILE_H_
 #define PAKFILE_H_
 
+#ifdef _MSC_VER
 #pragma warning(disable : 4334)
 #pragma warning(disable : 4267)
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "fastsearch.h"
+#include "gzipcodec.h"
+#include "parallel.h"
 
 extern "C"
 {
-#include "..\mini_gzip\miniz.c"
-#include "..\mini_gzip\mini_gzip.h"
-#include "..\mini_gzip\mini_gzip.c"
+#include "../mini_gzip/miniz.c"
+#include "../mini_gzip/mini_gzip.h"
+#include "../mini_gzip/mini_gzip.c"
 }
 
+// Built with the brotli package when xmake is configured with --brotli=y.
+#ifdef PAK_BROTLI
+#include <brotli/decode.h>
+#include <brotli/encode.h>
+#endif
+
 #pragma pack(push)
 #pragma pack(1)
 
@@ -39,140 +59,1054 @@ struct PAK_ALIAS {
 };
 #pragma pack(pop)
 
-bool CheckHeader(uint8_t* buffer,
-                 PAK_ENTRY*& pak_entry,
-                 PAK_ENTRY*& end_entry) {
-  uint32_t version = *(uint32_t*)buffer;
+// A resource inside the mapped pak, no copy is made.
+struct PakResource {
+  uint16_t id;
+  uint8_t* data;
+  uint32_t size;
+};
+
+// Validates the header and the entry table of a pak once, then looks
+// resources up by ID or by position with a binary search. Entries and v5
+// aliases are both sorted by resource ID, and entry offsets ascend, with a
+// sentinel entry of ID 0 holding the end of the last resource.
+class PakReader {
+ public:
+  PakReader(uint8_t* buffer, size_t size) : buffer_(buffer), size_(size) {
+    valid_ = Parse();
+  }
+
+  bool valid() const { return valid_; }
+  uint32_t version() const { return version_; }
+  size_t size() const { return size_; }
 
-  if (version != PACK4_FILE_VERSION && version != PACK5_FILE_VERSION)
+  // The header, the entry table and the alias table. Any change to the
+  // layout of the resources changes these bytes.
+  const uint8_t* index() const { return buffer_; }
+  size_t index_size() const { return index_size_; }
+
+  // Entries, not counting aliases.
+  size_t entry_count() const { return entry_count_; }
+  size_t alias_count() const { return alias_count_; }
+
+  PakResource entry(size_t index) const {
+    const PAK_ENTRY* current = entries_ + index;
+    const PAK_ENTRY* next = current + 1;
+    return {current->resource_id, buffer_ + current->file_offset,
+            next->file_offset - current->file_offset};
+  }
+
+  // Looks up an entry, or an alias of one, by resource ID.
+  bool FindById(uint16_t id, PakResource* resource) const {
+    const PAK_ENTRY* end = entries_ + entry_count_;
+    const PAK_ENTRY* found = std::lower_bound(
+        entries_, end, id, [](const PAK_ENTRY& entry, uint16_t value) {
+          return entry.resource_id < value;
+        });
+    if (found != end && found->resource_id == id) {
+      *resource = entry(found - entries_);
+      return true;
+    }
+
+    const PAK_ALIAS* alias_end = aliases_ + alias_count_;
+    const PAK_ALIAS* alias = std::lower_bound(
+        aliases_, alias_end, id, [](const PAK_ALIAS& alias, uint16_t value) {
+          return alias.resource_id < value;
+        });
+    if (alias != alias_end && alias->resource_id == id) {
+      *resource = entry(alias->entry_index);
+      resource->id = id;
+      return true;
+    }
     return false;
+  }
 
-  if (version == PACK4_FILE_VERSION) {
-    PAK4_HEADER* pak_header = (PAK4_HEADER*)(buffer + sizeof(uint32_t));
-    if (pak_header->encodeing != 1)
+  // The resource whose data contains `pos`.
+  bool FindByPosition(const uint8_t* pos, PakResource* resource) const {
+    if (pos < buffer_ || pos >= buffer_ + size_)
       return false;
+    uint32_t offset = (uint32_t)(pos - buffer_);
 
-    pak_entry = (PAK_ENTRY*)(buffer + sizeof(uint32_t) + sizeof(PAK4_HEADER));
-    end_entry = pak_entry + pak_header->num_entries;
+    // The last entry starting at or before `pos`; empty entries share their
+    // offset with the next one and are skipped this way.
+    const PAK_ENTRY* end = entries_ + entry_count_ + 1;
+    const PAK_ENTRY* next = std::upper_bound(
+        entries_, end, offset, [](uint32_t value, const PAK_ENTRY& entry) {
+          return value < entry.file_offset;
+        });
+    if (next == entries_ || next == end)
+      return false;
+    *resource = entry(next - 1 - entries_);
+    return true;
   }
 
-  if (version == PACK5_FILE_VERSION) {
-    PAK5_HEADER* pak_header = (PAK5_HEADER*)(buffer + sizeof(uint32_t));
-    if (pak_header->encodeing != 1)
+ private:
+  bool Parse() {
+    if (!buffer_ || size_ < sizeof(uint32_t))
+      return false;
+    version_ = *(uint32_t*)buffer_;
+
+    size_t table;
+    if (version_ == PACK4_FILE_VERSION) {
+      table = sizeof(uint32_t) + sizeof(PAK4_HEADER);
+      if (size_ < table)
+        return false;
+      PAK4_HEADER* pak_header = (PAK4_HEADER*)(buffer_ + sizeof(uint32_t));
+      if (pak_header->encodeing != 1)
+        return false;
+      entry_count_ = pak_header->num_entries;
+    } else if (version_ == PACK5_FILE_VERSION) {
+      table = sizeof(uint32_t) + sizeof(PAK5_HEADER);
+      if (size_ < table)
+        return false;
+      PAK5_HEADER* pak_header = (PAK5_HEADER*)(buffer_ + sizeof(uint32_t));
+      if (pak_header->encodeing != 1)
+        return false;
+      entry_count_ = pak_header->resource_count;
+      alias_count_ = pak_header->alias_count;
+    } else {
+      return false;
+    }
+
+    // The entries, the sentinel and the aliases must fit before the data.
+    uint64_t table_end = table +
+                         (uint64_t)(entry_count_ + 1) * sizeof(PAK_ENTRY) +
+                         (uint64_t)alias_count_ * sizeof(PAK_ALIAS);
+    if (table_end > size_)
       return false;
+    index_size_ = (size_t)table_end;
+    entries_ = (PAK_ENTRY*)(buffer_ + table);
+    aliases_ = (PAK_ALIAS*)(entries_ + entry_count_ + 1);
 
-    pak_entry = (PAK_ENTRY*)(buffer + sizeof(uint32_t) + sizeof(PAK5_HEADER));
-    end_entry = pak_entry + pak_header->resource_count;
+    // In order to save the "next item" of the last item,
+    // the id of this special item must be 0
+    if (entries_[entry_count_].resource_id != 0)
+      return false;
+
+    // FindById binary-searches both tables, so IDs must be strictly
+    // increasing in each.
+    uint32_t previous = (uint32_t)table_end;
+    for (size_t i = 0; i <= entry_count_; ++i) {
+      if (entries_[i].file_offset < previous || entries_[i].file_offset > size_)
+        return false;
+      if (i && i < entry_count_ &&
+          entries_[i].resource_id <= entries_[i - 1].resource_id) {
+        return false;
+      }
+      previous = entries_[i].file_offset;
+    }
+    for (size_t i = 0; i < alias_count_; ++i) {
+      if (aliases_[i].entry_index >= entry_count_)
+        return false;
+      if (i && aliases_[i].resource_id <= aliases_[i - 1].resource_id)
+        return false;
+    }
+    return true;
   }
 
-  // In order to save the "next item" of the last item,
-  // the id of this special item must be 0
-  if (!end_entry || end_entry->resource_id != 0)
+  uint8_t* buffer_;
+  size_t size_;
+  size_t index_size_ = 0;
+  bool valid_ = false;
+  uint32_t version_ = 0;
+  size_t entry_count_ = 0;
+  size_t alias_count_ = 0;
+  const PAK_ENTRY* entries_ = nullptr;
+  const PAK_ALIAS* aliases_ = nullptr;
+};
+
+template <typename Function>
+void PakFind(uint8_t* buffer, size_t size, uint8_t* pos, Function f) {
+  PakReader reader(buffer, size);
+  PakResource resource;
+  if (reader.valid() && reader.FindByPosition(pos, &resource)) {
+    f(resource.data, resource.size);
+  }
+}
+
+// The size of the gzip member header, 0 if it is malformed.
+size_t GzipHeaderSize(const uint8_t* data, size_t size) {
+  if (size < 18 || data[0] != 0x1F || data[1] != 0x8B || data[2] != 0x08)
+    return 0;
+  uint8_t flags = data[3];
+  size_t offset = 10;
+  if (flags & 0x04) {
+    // FEXTRA
+    offset += 2 + (data[offset] | (data[offset + 1] << 8));
+  }
+  for (uint8_t flag : {0x08, 0x10}) {
+    // FNAME and FCOMMENT are NUL-terminated.
+    if (!(flags & flag))
+      continue;
+    while (offset < size && data[offset])
+      ++offset;
+    ++offset;
+  }
+  if (flags & 0x02) {
+    // FHCRC
+    offset += 2;
+  }
+  // Leave room for the CRC32 and ISIZE trailer.
+  return offset + 8 <= size ? offset : 0;
+}
+
+// Inflated bytes are searched this many at a time.
+constexpr size_t kInflateWindowSize = 16 * 1024;
+
+// Inflate a gzip resource into a small window and call visit(data, size) on
+// each window, preceded by the last `overlap` bytes of the previous one, until
+// visit returns true. A resource is never held in memory as a whole this way.
+// Returns true if visit did.
+template <typename Visitor>
+bool GzipStream(const uint8_t* data,
+                size_t size,
+                size_t overlap,
+                Visitor visit) {
+  size_t header = GzipHeaderSize(data, size);
+  if (!header)
     return false;
 
-  return true;
+  mz_stream stream = {};
+  stream.next_in = data + header;
+  stream.avail_in = (unsigned int)(size - header - 8);
+  if (mz_inflateInit2(&stream, -MZ_DEFAULT_WINDOW_BITS) != MZ_OK)
+    return false;
+
+  std::vector<uint8_t> buffer(overlap + kInflateWindowSize);
+  size_t kept = 0;
+  bool found = false;
+  for (;;) {
+    stream.next_out = buffer.data() + kept;
+    stream.avail_out = (unsigned int)kInflateWindowSize;
+    int status = mz_inflate(&stream, MZ_NO_FLUSH);
+    size_t length = kept + kInflateWindowSize - stream.avail_out;
+    if (visit((const uint8_t*)buffer.data(), length)) {
+      found = true;
+      break;
+    }
+    if (status != MZ_OK)
+      break;
+
+    kept = (std::min)(length, overlap);
+    memmove(buffer.data(), buffer.data() + length - kept, kept);
+  }
+  mz_inflateEnd(&stream);
+  return found;
 }
 
-template <typename Function>
-void PakFind(uint8_t* buffer, uint8_t* pos, Function f) {
-  PAK_ENTRY* pak_entry = nullptr;
-  PAK_ENTRY* end_entry = nullptr;
+// Whether the inflated content of a gzip resource contains `marker`, keeping
+// the last (marker_size - 1) bytes across windows.
+bool GzipContains(const uint8_t* data,
+                  size_t size,
+                  const uint8_t* marker,
+                  size_t marker_size) {
+  if (!marker_size)
+    return false;
+  return GzipStream(data, size, marker_size - 1,
+                    [=](const uint8_t* window, size_t length) {
+                      return SearchBytes(window, length, marker,
+                                         marker_size) != nullptr;
+                    });
+}
 
-  // Check the file header.
-  if (!CheckHeader(buffer, pak_entry, end_entry))
-    return;
+// Chromium stores brotli resources behind the magic 0x1E 0x9B and the
+// decoded size in 6 bytes, little endian.
+constexpr size_t kBrotliHeaderSize = 8;
 
-  do {
-    PAK_ENTRY* next_entry = pak_entry + 1;
-    if (pos >= buffer + pak_entry->file_offset &&
-        pos <= buffer + next_entry->file_offset) {
-      f(buffer + pak_entry->file_offset,
-        next_entry->file_offset - pak_entry->file_offset);
+bool IsBrotliResource(const uint8_t* data, size_t size) {
+  return size > kBrotliHeaderSize && data[0] == 0x1E && data[1] == 0x9B;
+}
+
+uint64_t BrotliContentSize(const uint8_t* data) {
+  uint64_t size = 0;
+  for (int i = 0; i < 6; ++i) {
+    size |= (uint64_t)data[2 + i] << (8 * i);
+  }
+  return size;
+}
+
+void SetBrotliContentSize(uint8_t* data, uint64_t size) {
+  for (int i = 0; i < 6; ++i) {
+    data[2 + i] = (uint8_t)(size >> (8 * i));
+  }
+}
+
+#ifdef PAK_BROTLI
+// GzipStream for a brotli resource. The decoder keeps no more than the
+// window of the stream, the content is visited a window at a time.
+template <typename Visitor>
+bool BrotliStream(const uint8_t* data,
+                  size_t size,
+                  size_t overlap,
+                  Visitor visit) {
+  if (!IsBrotliResource(data, size))
+    return false;
+  BrotliDecoderState* state =
+      BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+  if (!state)
+    return false;
+
+  const uint8_t* next_in = data + kBrotliHeaderSize;
+  size_t available_in = size - kBrotliHeaderSize;
+  std::vector<uint8_t> buffer(overlap + kInflateWindowSize);
+  size_t kept = 0;
+  bool found = false;
+  for (;;) {
+    uint8_t* next_out = buffer.data() + kept;
+    size_t available_out = kInflateWindowSize;
+    BrotliDecoderResult result = BrotliDecoderDecompressStream(
+        state, &available_in, &next_in, &available_out, &next_out, nullptr);
+    size_t length = kept + kInflateWindowSize - available_out;
+    if (visit((const uint8_t*)buffer.data(), length)) {
+      found = true;
       break;
     }
+    if (result != BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT)
+      break;
 
-    pak_entry = next_entry;
-  } while (pak_entry->resource_id != 0);
+    kept = (std::min)(length, overlap);
+    memmove(buffer.data(), buffer.data() + length - kept, kept);
+  }
+  BrotliDecoderDestroyInstance(state);
+  return found;
 }
+#endif  // PAK_BROTLI
 
-template <typename Function>
-void TraversalGZIPFile(uint8_t* buffer, Function f) {
-  PAK_ENTRY* pak_entry = NULL;
-  PAK_ENTRY* end_entry = NULL;
+// GzipStream or BrotliStream, whichever the resource is compressed with.
+// Returns false for anything else.
+template <typename Visitor>
+bool PakStream(const PakResource& resource, size_t overlap, Visitor visit) {
+#ifdef PAK_BROTLI
+  if (IsBrotliResource(resource.data, resource.size))
+    return BrotliStream(resource.data, resource.size, overlap, visit);
+#endif
+  return GzipStream(resource.data, resource.size, overlap, visit);
+}
+
+// The decoded size of a gzip or brotli resource, 0 for anything else.
+size_t PakContentSize(const PakResource& resource) {
+  if (IsBrotliResource(resource.data, resource.size))
+    return (size_t)BrotliContentSize(resource.data);
+  if (resource.size >= 18 && resource.data[0] == 0x1F &&
+      resource.data[1] == 0x8B) {
+    uint32_t original_size;
+    memcpy(&original_size, resource.data + resource.size - 4,
+           sizeof(original_size));
+    return original_size;
+  }
+  return 0;
+}
+
+// How far back deflate matches reach.
+constexpr size_t kDeflateWindowSize = 32 * 1024;
+
+// miniz as bundled with mini_gzip. tinfl does not tell where blocks start,
+// so with it patched resources are always compressed whole.
+class MinizGzipCodec : public GzipCodec {
+ public:
+  MinizGzipCodec()
+      : compressor_(new tdefl_compressor), scratch_(2 * kDeflateWindowSize) {}
+
+  const char* name() const override { return "miniz"; }
+
+  bool Inflate(const uint8_t* in,
+               size_t in_size,
+               uint8_t* out,
+               size_t out_size,
+               std::vector<DeflateBlock>* blocks) override {
+    blocks->clear();
+    return tinfl_decompress_mem_to_mem(out, out_size, in, in_size, 0) ==
+           out_size;
+  }
+
+  // tdefl has no preset dictionary. The primed bytes are compressed first
+  // and their output dropped, up to a sync flush, so that matches can still
+  // refer back to them.
+  size_t Deflate(const uint8_t* data,
+                 size_t size,
+                 size_t primed,
+                 int level,
+                 uint8_t* out,
+                 size_t capacity) override {
+    mz_uint flags = tdefl_create_comp_flags_from_zip_params(
+        level, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+    if (tdefl_init(compressor_.get(), nullptr, nullptr, (int)flags) !=
+        TDEFL_STATUS_OKAY) {
+      return 0;
+    }
+    if (primed) {
+      size_t in_size = primed;
+      size_t out_size = scratch_.size();
+      if (tdefl_compress(compressor_.get(), data - primed, &in_size,
+                         scratch_.data(), &out_size,
+                         TDEFL_SYNC_FLUSH) != TDEFL_STATUS_OKAY ||
+          in_size != primed || out_size == scratch_.size()) {
+        return 0;
+      }
+    }
+    size_t in_size = size;
+    size_t out_size = capacity;
+    if (tdefl_compress(compressor_.get(), data, &in_size, out, &out_size,
+                       TDEFL_FINISH) != TDEFL_STATUS_DONE) {
+      return 0;
+    }
+    return out_size;
+  }
+
+  uint32_t Crc32(uint32_t crc, const uint8_t* data, size_t size) override {
+    return (uint32_t)mz_crc32(crc, data, size);
+  }
 
-  // Check the file header.
-  if (!CheckHeader(buffer, pak_entry, end_entry))
-    return;
+ private:
+  std::unique_ptr<tdefl_compressor> compressor_;
+  std::vector<uint8_t> scratch_;
+};
+
+// "fast" or "miniz", nullptr for any other name.
+std::unique_ptr<GzipCodec> CreateGzipCodec(const char* name) {
+  if (!strcmp(name, "fast"))
+    return std::unique_ptr<GzipCodec>(new FastGzipCodec);
+  if (!strcmp(name, "miniz"))
+    return std::unique_ptr<GzipCodec>(new MinizGzipCodec);
+  return nullptr;
+}
+
+// The codec pak patching uses.
+constexpr char kPakGzipCodec[] = "fast";
+
+// How much patched content may grow beyond the original. Whether it then
+// still fits the slot is up to the compression.
+constexpr size_t kPakPatchHeadroom = 256 * 1024;
+
+// Buffers reused across the resources one thread patches, so that patching
+// does not allocate per entry. They grow to the largest resource seen, or to
+// the sizes given to Reserve() up front. The content buffers keep
+// kPakPatchHeadroom bytes of room beyond `content_size`.
+struct PakPatchArena {
+  std::vector<uint8_t> content;
+  std::vector<uint8_t> original;
+  std::vector<uint8_t> deflated;
+  std::vector<DeflateBlock> blocks;
+  std::unique_ptr<GzipCodec> codec;
+
+  void Reserve(size_t content_size, size_t slot_size) {
+    if (content.size() < content_size + kPakPatchHeadroom) {
+      content.resize(content_size + kPakPatchHeadroom);
+      original.resize(content_size + kPakPatchHeadroom);
+    }
+    if (deflated.size() < slot_size)
+      deflated.resize(slot_size);
+    if (!codec)
+      codec = CreateGzipCodec(kPakGzipCodec);
+  }
+};
+
+// A gzip member needs 18 bytes around the deflate data and the padding
+// needs at least 2 more for the FEXTRA length.
+constexpr size_t kGzipSlotOverhead = 10 + 2 + 8;
 
+// Compression levels tried in turn until the output fits the slot. Most
+// patches barely change the size, so the fastest level usually fits.
+constexpr int kSlotLevels[] = {1, 6, 9};
+
+// Deflate `size` bytes into at most `capacity` bytes at `out`, letting
+// matches reach back into the `primed` bytes before `data`. Returns the
+// deflated size, 0 if even the highest level does not fit.
+size_t DeflateToFit(PakPatchArena& arena,
+                    const uint8_t* data,
+                    size_t size,
+                    size_t primed,
+                    uint8_t* out,
+                    size_t capacity) {
+  for (int level : kSlotLevels) {
+    size_t deflated_size =
+        arena.codec->Deflate(data, size, primed, level, out, capacity);
+    if (deflated_size)
+      return deflated_size;
+  }
+  return 0;
+}
+
+// Deflate `size` bytes of patched content into at most `capacity` bytes at
+// `out`, reusing the blocks of the original `compressed` data that end
+// before the first `unchanged` bytes do; arena.blocks must list its blocks.
+// They are copied bit for bit and followed by an empty stored block, which
+// ends on a byte boundary, and only the content after them is compressed,
+// primed with the window before it. Returns the deflated size, 0 if there is
+// nothing to reuse or it does not fit.
+size_t SpliceDeflate(PakPatchArena& arena,
+                     const uint8_t* compressed,
+                     const uint8_t* content,
+                     size_t size,
+                     size_t unchanged,
+                     uint8_t* out,
+                     size_t capacity) {
+  const DeflateBlock* block = nullptr;
+  for (const auto& candidate : arena.blocks) {
+    if (candidate.output_offset > unchanged)
+      break;
+    if (candidate.output_offset)
+      block = &candidate;
+  }
+  if (!block)
+    return 0;
+
+  size_t bits = block->bit_offset;
+  size_t aligned = (bits + 3 + 7) / 8;
+  size_t prefix = aligned + 4;
+  if (prefix >= capacity)
+    return 0;
+  memcpy(out, compressed, bits / 8);
+  memset(out + bits / 8, 0, prefix - bits / 8);
+  if (bits % 8)
+    out[bits / 8] = compressed[bits / 8] & ((1 << (bits % 8)) - 1);
+  // BFINAL 0 and BTYPE 00 are zero bits, LEN is 0 and NLEN 0xFFFF.
+  out[aligned + 2] = 0xFF;
+  out[aligned + 3] = 0xFF;
+
+  size_t offset = block->output_offset;
+  size_t rest = DeflateToFit(arena, content + offset, size - offset,
+                             (std::min)(offset, kDeflateWindowSize),
+                             out + prefix, capacity - prefix);
+  return rest ? prefix + rest : 0;
+}
+
+// Deflate data of stored blocks takes 5 bytes per 65535 besides the data.
+size_t StoredDeflateSize(size_t size) {
+  return size + 5 * (std::max)((size_t)1, (size + 0xFFFE) / 0xFFFF);
+}
+
+// Write `size` bytes as stored deflate blocks, StoredDeflateSize(size) bytes
+// in all. Each starts byte-aligned with BFINAL, BTYPE 00, LEN and NLEN.
+void WriteStoredDeflate(uint8_t* out, const uint8_t* data, size_t size) {
   do {
-    PAK_ENTRY* next_entry = pak_entry + 1;
-    uint32_t old_size = next_entry->file_offset - pak_entry->file_offset;
+    uint16_t length = (uint16_t)(std::min)(size, (size_t)0xFFFF);
+    uint16_t inverted = (uint16_t)~length;
+    out[0] = length == size ? 0x01 : 0x00;
+    memcpy(out + 1, &length, sizeof(length));
+    memcpy(out + 3, &inverted, sizeof(inverted));
+    memcpy(out + 5, data, length);
+    out += 5 + length;
+    data += length;
+    size -= length;
+  } while (size);
+}
+
+// Rewrite the gzip member filling `slot` for `deflated_size` bytes of new
+// deflate data, keeping its MTIME, XFL and OS, and return where the deflate
+// data goes. The bytes left over are taken up by an FEXTRA field, or by an
+// FCOMMENT when there are more than FEXTRA can hold, so the member keeps its
+// size and the pak its offsets.
+uint8_t* LayoutGzipSlot(uint8_t* slot,
+                        size_t slot_size,
+                        size_t deflated_size,
+                        uint32_t crc,
+                        uint32_t original_size) {
+  size_t padding = slot_size - 18 - deflated_size;
+  uint8_t* p = slot + 10;
+  if (padding - 2 <= 0xFFFF) {
+    slot[3] = 0x04;  // FEXTRA
+    uint16_t extra_length = (uint16_t)(padding - 2);
+    memcpy(p, &extra_length, sizeof(extra_length));
+    memset(p + 2, '\0', extra_length);
+  } else {
+    slot[3] = 0x10;  // FCOMMENT
+    memset(p, ' ', padding - 1);
+    p[padding - 1] = '\0';
+  }
+  uint8_t* trailer = slot + slot_size - 8;
+  memcpy(trailer, &crc, sizeof(crc));
+  memcpy(trailer + 4, &original_size, sizeof(original_size));
+  return p + padding;
+}
 
-    if (old_size < 10 * 1024) {
-      // Files smaller than 10 kb are skipped.
-      pak_entry = next_entry;
+// Inflate one gzip resource, let f(id, data, size, new_len) edit it, and
+// write it back compressed in place. On entry new_len is the room there is at
+// data, f sets it to the patched size. Returns true if the resource was
+// rewritten. Only resources for which select(resource) is true are inflated
+// in full; select can look into the content with GzipStream. All buffers
+// come from `arena`.
+template <typename Select, typename Function>
+bool PatchGZIPEntry(const PakResource& resource,
+                    Select& select,
+                    Function& f,
+                    PakPatchArena& arena) {
+  uint8_t* data = resource.data;
+  uint32_t old_size = resource.size;
+
+  if (old_size < 10 * 1024) {
+    // Files smaller than 10 kb are skipped.
+    return false;
+  }
+
+  uint8_t gzip[] = {0x1F, 0x8B, 0x08};
+  size_t gzip_len = sizeof(gzip);
+  if (memcmp(data, gzip, gzip_len) != 0) {
+    // Files that are not gzip format are skipped.
+    return false;
+  }
+
+  size_t header = GzipHeaderSize(data, old_size);
+  if (!header || !select(resource))
+    return false;
+
+  uint32_t original_size;
+  memcpy(&original_size, data + old_size - 4, sizeof(original_size));
+  arena.Reserve(original_size, old_size);
+  const uint8_t* compressed = data + header;
+  uint8_t* original = arena.original.data();
+  if (!arena.codec->Inflate(compressed, old_size - header - 8, original,
+                            original_size, &arena.blocks)) {
+    return false;
+  }
+  uint8_t* content = arena.content.data();
+  memcpy(content, original, original_size);
+
+  uint32_t new_len = (uint32_t)arena.content.size();
+  if (!f(resource.id, content, original_size, new_len))
+    return false;
+
+  uint32_t crc = arena.codec->Crc32(0, content, new_len);
+  size_t capacity = old_size - kGzipSlotOverhead;
+
+  // Content that fits uncompressed is stored, which costs a copy instead of
+  // a deflate.
+  size_t stored_size = StoredDeflateSize(new_len);
+  if (stored_size <= capacity) {
+    uint8_t* out = LayoutGzipSlot(data, old_size, stored_size, crc, new_len);
+    WriteStoredDeflate(out, content, new_len);
+    return true;
+  }
+
+  // Patches often leave most of the content before them as it was, whose
+  // compressed blocks are kept.
+  uint8_t* deflated = arena.deflated.data();
+  size_t unchanged =
+      std::mismatch(content, content + new_len, original).first - content;
+  size_t deflated_size = SpliceDeflate(arena, compressed, content, new_len,
+                                       unchanged, deflated, capacity);
+#ifndef NDEBUG
+  if (deflated_size &&
+      (!arena.codec->Inflate(deflated, deflated_size, original, new_len,
+                             &arena.blocks) ||
+       memcmp(original, content, new_len) != 0)) {
+    DebugLog(L"Spliced resource %d does not round-trip", resource.id);
+    deflated_size = 0;
+  }
+#endif
+  if (!deflated_size) {
+    deflated_size =
+        DeflateToFit(arena, content, new_len, 0, deflated, capacity);
+  }
+  if (!deflated_size) {
+    DebugLog(L"Patched resource %d does not fit in %d bytes", resource.id,
+             old_size);
+    return false;
+  }
+  memcpy(LayoutGzipSlot(data, old_size, deflated_size, crc, new_len),
+         deflated, deflated_size);
+  return true;
+}
+
+#ifdef PAK_BROTLI
+// Brotli qualities tried in turn until the output fits the slot.
+constexpr int kBrotliQualities[] = {5, 9, 11};
+
+// PatchGZIPEntry for a brotli resource. The decoded size in the header is
+// updated and the bytes the new stream leaves over are zeroed; decoders
+// stop at the last meta-block and never read them.
+template <typename Select, typename Function>
+bool PatchBrotliEntry(const PakResource& resource,
+                      Select& select,
+                      Function& f,
+                      PakPatchArena& arena) {
+  uint8_t* data = resource.data;
+  uint32_t old_size = resource.size;
+  if (old_size < 10 * 1024 || !IsBrotliResource(data, old_size))
+    return false;
+
+  uint64_t original_size = BrotliContentSize(data);
+  if (original_size > UINT32_MAX || !select(resource))
+    return false;
+
+  arena.Reserve((size_t)original_size, old_size);
+  uint8_t* content = arena.content.data();
+  size_t decoded_size = (size_t)original_size;
+  if (BrotliDecoderDecompress(old_size - kBrotliHeaderSize,
+                              data + kBrotliHeaderSize, &decoded_size,
+                              content) != BROTLI_DECODER_RESULT_SUCCESS ||
+      decoded_size != original_size) {
+    return false;
+  }
+
+  uint32_t new_len = (uint32_t)arena.content.size();
+  if (!f(resource.id, content, (uint32_t)original_size, new_len))
+    return false;
+
+  size_t capacity = old_size - kBrotliHeaderSize;
+  uint8_t* encoded = arena.deflated.data();
+  size_t encoded_size = 0;
+  for (int quality : kBrotliQualities) {
+    encoded_size = capacity;
+    if (BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                              new_len, content, &encoded_size, encoded)) {
+      break;
+    }
+    encoded_size = 0;
+  }
+  if (!encoded_size) {
+    DebugLog(L"Patched resource %d does not fit in %d bytes", resource.id,
+             old_size);
+    return false;
+  }
+
+  SetBrotliContentSize(data, new_len);
+  memcpy(data + kBrotliHeaderSize, encoded, encoded_size);
+  memset(data + kBrotliHeaderSize + encoded_size, 0, capacity - encoded_size);
+  return true;
+}
+#endif  // PAK_BROTLI
+
+// PatchGZIPEntry or PatchBrotliEntry, whichever the resource is compressed
+// with. Brotli resources are left alone when built without brotli.
+template <typename Select, typename Function>
+bool PatchPakEntry(const PakResource& resource,
+                   Select& select,
+                   Function& f,
+                   PakPatchArena& arena) {
+  if (IsBrotliResource(resource.data, resource.size)) {
+#ifdef PAK_BROTLI
+    return PatchBrotliEntry(resource, select, f, arena);
+#else
+    return false;
+#endif
+  }
+  return PatchGZIPEntry(resource, select, f, arena);
+}
+
+// Copy-on-write privatizes memory a page at a time.
+constexpr size_t kPakPageSize = 4096;
+
+// The pages of the pak that patching the resources `ids` in place writes
+// to, as offsets from its start in ascending order. The patchers rewrite a
+// slot from its header to its end, so these are the pages the slots overlap.
+std::vector<size_t> PakPatchedPages(const PakReader& reader,
+                                    const std::vector<uint16_t>& ids) {
+  std::vector<size_t> pages;
+  for (uint16_t id : ids) {
+    PakResource resource;
+    if (!reader.FindById(id, &resource) || !resource.size)
       continue;
+    size_t begin = resource.data - reader.index();
+    size_t end = begin + resource.size;
+    for (size_t page = begin / kPakPageSize * kPakPageSize; page < end;
+         page += kPakPageSize) {
+      pages.push_back(page);
     }
+  }
+  std::sort(pages.begin(), pages.end());
+  pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+  return pages;
+}
+
+// Compression of resources written out of place. The pak is rebuilt once,
+// so the smallest output is worth the time.
+constexpr int kRebuildLevel = 9;
+constexpr int kRebuildBrotliQuality = 11;
+
+// Inflate one gzip resource, let f(id, data, size, new_len) edit it as for
+// PatchGZIPEntry, and compress it into `out` as a new gzip member of any
+// size. The member keeps MTIME, XFL and OS and drops the optional fields.
+template <typename Select, typename Function>
+bool RebuildGZIPEntry(const PakResource& resource,
+                      Select& select,
+                      Function& f,
+                      PakPatchArena& arena,
+                      std::vector<uint8_t>* out) {
+  const uint8_t* data = resource.data;
+  uint32_t old_size = resource.size;
+  if (old_size < 10 * 1024)
+    return false;
+
+  size_t header = GzipHeaderSize(data, old_size);
+  if (!header || !select(resource))
+    return false;
+
+  uint32_t original_size;
+  memcpy(&original_size, data + old_size - 4, sizeof(original_size));
+  arena.Reserve(original_size, old_size);
+  uint8_t* content = arena.content.data();
+  if (!arena.codec->Inflate(data + header, old_size - header - 8, content,
+                            original_size, &arena.blocks)) {
+    return false;
+  }
+
+  uint32_t new_len = (uint32_t)arena.content.size();
+  if (!f(resource.id, content, original_size, new_len))
+    return false;
+
+  size_t capacity = StoredDeflateSize(new_len);
+  out->resize(10 + capacity + 8);
+  uint8_t* member = out->data();
+  memcpy(member, data, 10);
+  member[3] = 0;
+  size_t deflated_size = arena.codec->Deflate(content, new_len, 0,
+                                              kRebuildLevel, member + 10,
+                                              capacity);
+  if (!deflated_size) {
+    WriteStoredDeflate(member + 10, content, new_len);
+    deflated_size = capacity;
+  }
+  uint32_t crc = arena.codec->Crc32(0, content, new_len);
+  uint8_t* trailer = member + 10 + deflated_size;
+  memcpy(trailer, &crc, sizeof(crc));
+  memcpy(trailer + 4, &new_len, sizeof(new_len));
+  out->resize(10 + deflated_size + 8);
+  return true;
+}
+
+#ifdef PAK_BROTLI
+// RebuildGZIPEntry for a brotli resource.
+template <typename Select, typename Function>
+bool RebuildBrotliEntry(const PakResource& resource,
+                        Select& select,
+                        Function& f,
+                        PakPatchArena& arena,
+                        std::vector<uint8_t>* out) {
+  const uint8_t* data = resource.data;
+  uint32_t old_size = resource.size;
+  if (old_size < 10 * 1024 || !IsBrotliResource(data, old_size))
+    return false;
+
+  uint64_t original_size = BrotliContentSize(data);
+  if (original_size > UINT32_MAX || !select(resource))
+    return false;
+
+  arena.Reserve((size_t)original_size, old_size);
+  uint8_t* content = arena.content.data();
+  size_t decoded_size = (size_t)original_size;
+  if (BrotliDecoderDecompress(old_size - kBrotliHeaderSize,
+                              data + kBrotliHeaderSize, &decoded_size,
+                              content) != BROTLI_DECODER_RESULT_SUCCESS ||
+      decoded_size != original_size) {
+    return false;
+  }
+
+  uint32_t new_len = (uint32_t)arena.content.size();
+  if (!f(resource.id, content, (uint32_t)original_size, new_len))
+    return false;
+
+  size_t encoded_size = BrotliEncoderMaxCompressedSize(new_len);
+  out->resize(kBrotliHeaderSize + encoded_size);
+  memcpy(out->data(), data, 2);
+  SetBrotliContentSize(out->data(), new_len);
+  if (!BrotliEncoderCompress(kRebuildBrotliQuality, BROTLI_DEFAULT_WINDOW,
+                             BROTLI_MODE_TEXT, new_len, content,
+                             &encoded_size, out->data() + kBrotliHeaderSize)) {
+    return false;
+  }
+  out->resize(kBrotliHeaderSize + encoded_size);
+  return true;
+}
+#endif  // PAK_BROTLI
+
+// RebuildGZIPEntry or RebuildBrotliEntry, whichever the resource is
+// compressed with.
+template <typename Select, typename Function>
+bool RebuildPakEntry(const PakResource& resource,
+                     Select& select,
+                     Function& f,
+                     PakPatchArena& arena,
+                     std::vector<uint8_t>* out) {
+  if (IsBrotliResource(resource.data, resource.size)) {
+#ifdef PAK_BROTLI
+    return RebuildBrotliEntry(resource, select, f, arena, out);
+#else
+    return false;
+#endif
+  }
+  return RebuildGZIPEntry(resource, select, f, arena, out);
+}
+
+// Arenas that hold buffers at any one time. Every worker scans, but only the
+// few entries the rules select are patched, so patching two at a time keeps
+// the peak memory of startup near that of a serial patch.
+constexpr size_t kPakArenaPoolSize = 2;
 
-    BYTE gzip[] = {0x1F, 0x8B, 0x08};
-    size_t gzip_len = sizeof(gzip);
-    if (memcmp(buffer + pak_entry->file_offset, gzip, gzip_len) != 0) {
-      // Files that are not gzip format are skipped.
-      pak_entry = next_entry;
+// Run patch(index, select, arena) on the entries of the pak on up to
+// `workers` threads, stopping once `targets` of them returned true (0 means
+// all). Each worker takes entries from a shared counter. Its arena is empty
+// until `select` passes; then it borrows the buffers of one of
+// kPakArenaPoolSize arenas, waiting for one if all are in use, reserved for
+// the largest compressed resource, and returns them once the entry is done.
+// Returns the IDs of the entries patched in pak order.
+template <typename Select, typename Patch>
+std::vector<uint16_t> ForEachPakEntry(const PakReader& reader,
+                                      Select& select,
+                                      Patch patch,
+                                      size_t targets,
+                                      size_t workers) {
+  size_t max_content = 0;
+  size_t max_slot = 0;
+  for (size_t i = 0; i < reader.entry_count(); ++i) {
+    PakResource resource = reader.entry(i);
+    size_t content_size = PakContentSize(resource);
+    if (resource.size < 10 * 1024 || !content_size ||
+        content_size > UINT32_MAX) {
       continue;
     }
+    max_content = (std::max)(max_content, content_size);
+    max_slot = (std::max)(max_slot, (size_t)resource.size);
+  }
 
-    uint32_t original_size = *(uint32_t*)(buffer + next_entry->file_offset - 4);
-    uint8_t* unpack_buffer = (uint8_t*)malloc(original_size);
-    if (!unpack_buffer)
-      return;
-
-    struct mini_gzip gz;
-    mini_gz_start(&gz, buffer + pak_entry->file_offset, old_size);
-    int unpack_len = mini_gz_unpack(&gz, unpack_buffer, original_size);
-
-    if (original_size == unpack_len) {
-      uint32_t new_len = old_size;
-      bool changed = f(unpack_buffer, unpack_len, new_len);
-      if (changed) {
-        // If the file is changed.
-        size_t compress_size = 0;
-        uint8_t* compress_buffer =
-            (uint8_t*)gzip_compress(unpack_buffer, new_len, &compress_size);
-        if (compress_buffer && compress_size < old_size) {
-          /*FILE *fp = fopen("test.gz", "wb");
-                    fwrite(compress_buffer, compress_size, 1, fp);
-                    fclose(fp);*/
-
-          // gzip header
-          memcpy(buffer + pak_entry->file_offset, compress_buffer, 10);
-
-          // extra
-          buffer[pak_entry->file_offset + 3] = 0x04;
-          uint16_t extra_length = old_size - compress_size - 2;
-          memcpy(buffer + pak_entry->file_offset + 10, &extra_length,
-                 sizeof(extra_length));
-          memset(buffer + pak_entry->file_offset + 12, '\0', extra_length);
-
-          // compress
-          memcpy(buffer + pak_entry->file_offset + 12 + extra_length,
-                 compress_buffer + 10, compress_size - 10);
-
-          /*fp = fopen("test2.gz", "wb");
-                    fwrite(buffer + pak_entry->file_offset, old_size, 1, fp);
-                    fclose(fp);*/
-        } else {
-          DebugLog(L"gzip compress error %d %d", compress_size, old_size);
-        }
+  workers = (std::max)((size_t)1, (std::min)(workers, reader.entry_count()));
+  std::vector<PakPatchArena> pool((std::min)(workers, kPakArenaPoolSize));
+  std::vector<PakPatchArena*> idle;
+  for (auto& arena : pool) {
+    idle.push_back(&arena);
+  }
+  std::mutex pool_lock;
+  std::condition_variable pool_ready;
 
-        if (compress_buffer)
-          free(compress_buffer);
+  std::vector<uint8_t> rewritten(reader.entry_count(), 0);
+  std::atomic<size_t> next{0};
+  std::atomic<size_t> found{0};
+  ParallelFor(workers, workers, [&](size_t) {
+    PakPatchArena arena;
+    PakPatchArena* borrowed = nullptr;
+    auto borrow_and_select = [&](const PakResource& resource) {
+      if (!select(resource))
+        return false;
+      if (!borrowed) {
+        std::unique_lock<std::mutex> hold(pool_lock);
+        pool_ready.wait(hold, [&]() { return !idle.empty(); });
+        borrowed = idle.back();
+        idle.pop_back();
+        hold.unlock();
+        std::swap(arena, *borrowed);
+        arena.Reserve(max_content, max_slot);
+      }
+      return true;
+    };
+    for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) <
+                    reader.entry_count();) {
+      if (targets && found.load(std::memory_order_relaxed) >= targets)
+        return;
+      bool patched = patch(i, borrow_and_select, arena);
+      if (borrowed) {
+        std::swap(arena, *borrowed);
+        {
+          std::lock_guard<std::mutex> hold(pool_lock);
+          idle.push_back(borrowed);
+        }
+        pool_ready.notify_one();
+        borrowed = nullptr;
       }
+      if (patched) {
+        rewritten[i] = 1;
+        found.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  });
+
+  std::vector<uint16_t> patched;
+  for (size_t i = 0; i < reader.entry_count(); ++i) {
+    if (rewritten[i]) {
+      patched.push_back(reader.entry(i).id);
     }
+  }
+  return patched;
+}
+
+// Patch the gzip and brotli resources of the pak that `select` picks on up to
+// `workers` threads, stopping once `targets` of them were rewritten (0 means
+// all). Resources occupy disjoint ranges of the view and f only ever sees its
+// own decoded copy, so select and f must be safe to call concurrently and the
+// output does not depend on the order the entries are processed in. Returns
+// the IDs of the rewritten resources in pak order.
+template <typename Select, typename Function>
+std::vector<uint16_t> TraversalGZIPFile(const PakReader& reader,
+                                        Select select,
+                                        Function f,
+                                        size_t targets = 0,
+                                        size_t workers = DefaultWorkerCount()) {
+  return ForEachPakEntry(
+      reader, select,
+      [&](size_t index, auto& selects, PakPatchArena& arena) {
+        return PatchPakEntry(reader.entry(index), selects, f, arena);
+      },
+      targets, workers);
+}
 
-    free(unpack_buffer);
-    pak_entry = next_entry;
-  } while (pak_entry->resource_id != 0);
+// TraversalGZIPFile for a pak that is written anew: the patched resources
+// go to `rebuilt`, indexed by entry and empty for the others, and may be of
+// any size. The view is only read.
+template <typename Select, typename Function>
+std::vector<uint16_t> RebuildGZIPFile(
+    const PakReader& reader,
+    Select select,
+    Function f,
+    std::vector<std::vector<uint8_t>>* rebuilt,
+    size_t targets = 0,
+    size_t workers = DefaultWorkerCount()) {
+  rebuilt->assign(reader.entry_count(), {});
+  return ForEachPakEntry(
+      reader, select,
+      [&](size_t index, auto& selects, PakPatchArena& arena) {
+        return RebuildPakEntry(reader.entry(index), selects, f, arena,
+                               &(*rebuilt)[index]);
+      },
+      targets, workers);
+}
+
+// Write the pak with the entries that have data in `rebuilt` replaced by it
+// through write(data, size), in order. The header and the alias table are
+// kept and the entry table moves the offsets; everything between two
+// replaced entries is one write straight from the view. Returns false if a
+// write fails or the pak would outgrow 32-bit offsets.
+template <typename Writer>
+bool WriteRebuiltPak(const PakReader& reader,
+                     const std::vector<std::vector<uint8_t>>& rebuilt,
+                     Writer write) {
+  const uint8_t* buffer = reader.index();
+  size_t entry_count = reader.entry_count();
+  size_t aliases = reader.alias_count() * sizeof(PAK_ALIAS);
+  size_t table = reader.index_size() - aliases -
+                 (entry_count + 1) * sizeof(PAK_ENTRY);
+
+  std::vector<PAK_ENTRY> entries(entry_count + 1);
+  memcpy(entries.data(), buffer + table, entries.size() * sizeof(PAK_ENTRY));
+  int64_t shift = 0;
+  for (size_t i = 0; i <= entry_count; ++i) {
+    int64_t offset = (int64_t)entries[i].file_offset + shift;
+    if (offset > UINT32_MAX)
+      return false;
+    if (i < entry_count && !rebuilt[i].empty())
+      shift += (int64_t)rebuilt[i].size() - reader.entry(i).size;
+    entries[i].file_offset = (uint32_t)offset;
+  }
+  if ((int64_t)reader.size() + shift > UINT32_MAX)
+    return false;
+
+  if (!write(buffer, table) ||
+      !write((const uint8_t*)entries.data(),
+             entries.size() * sizeof(PAK_ENTRY)) ||
+      !write(buffer + reader.index_size() - aliases, aliases)) {
+    return false;
+  }
+  size_t copied = reader.index_size();
+  for (size_t i = 0; i < entry_count; ++i) {
+    if (rebuilt[i].empty())
+      continue;
+    PakResource resource = reader.entry(i);
+    size_t offset = resource.data - buffer;
+    if (!write(buffer + copied, offset - copied) ||
+        !write(rebuilt[i].data(), rebuilt[i].size())) {
+      return false;
+    }
+    copied = offset + resource.size;
+  }
+  return write(buffer + copied, reader.size() - copied);
 }
 
 #endif  // PAKFILE_H_
@@ -1,84 +1,623 @@
 #ifndef PAKPATCH_H_
 #define PAKPATCH_H_
 
-#include "pakfile.h"
+#include <tlhelp32.h>
 
-DWORD resources_pak_size = 0;
-HANDLE resources_pak_map = nullptr;
-HANDLE resources_pak_file = nullptr;
+#include "pakfile.h"
+#include "pakrules.h"
 
 auto RawCreateFile = CreateFileW;
 auto RawCreateFileMapping = CreateFileMappingW;
 auto RawMapViewOfFile = MapViewOfFile;
 
+// Built in: hide the update status and add Chrome++ to the about page.
+PakRule AboutPageRule() {
+  PakRule rule;
+  rule.name = "about page";
+  rule.marker = R"(</settings-about-page>)";
+
+  // Compress the HTML for writing patch information.
+  rule.compress_html = true;
+
+  // RemoveUpdateError
+  // if (IsNeedPortable())
+  {
+    rule.replacements.push_back(
+        {R"(hidden="[[!showUpdateStatus_]]")", R"(hidden="true")"});
+    rule.replacements.push_back(
+        {R"(hidden="[[!shouldShowIcons_(showUpdateStatus_)]]")",
+         R"(hidden="true")"});
+  }
+
+  const char prouct_title[] = u8R"({aboutBrowserVersion}</div><div class="secondary"><a target="_blank" href="https://github.com/Bush2021/chrome_plus">Chrome++</a> )" RELEASE_VER_STR u8R"( modified version</div>)";
+  rule.replacements.push_back({R"({aboutBrowserVersion}</div>)", prouct_title});
+  return rule;
+}
+
+// A pak to patch and the rules for it.
+struct PakTarget {
+  std::string pak;
+  PakRuleSet rules;
+};
+
+// The built-in rules followed by those of the pak_rules file, if any, by the
+// pak they patch. A file that does not parse is ignored as a whole.
+const std::vector<PakTarget>& GetPakTargets() {
+  static const std::vector<PakTarget> targets = []() {
+    PakRuleSet rules;
+    rules.Add(AboutPageRule());
+
+    auto path = GetPakRulesPath();
+    FILE* fp = path.empty() ? nullptr : _wfopen(path.c_str(), L"rb");
+    if (fp) {
+      std::string text;
+      char buffer[4096];
+      for (size_t read; (read = fread(buffer, 1, sizeof(buffer), fp)) > 0;) {
+        text.append(buffer, read);
+      }
+      fclose(fp);
+
+      PakRuleSet parsed;
+      std::string error;
+      if (ParsePakRules(text, &parsed, &error)) {
+        for (const auto& rule : parsed.rules()) {
+          rules.Add(rule);
+        }
+      } else {
+        DebugLog(L"Parse %s failed, %s", path.c_str(),
+                 std::wstring(error.begin(), error.end()).c_str());
+      }
+    }
+
+    std::vector<PakTarget> targets;
+    for (const auto& rule : rules.rules()) {
+      auto target = std::find_if(
+          targets.begin(), targets.end(),
+          [&](const PakTarget& target) { return target.pak == rule.pak; });
+      if (target == targets.end()) {
+        targets.push_back({rule.pak, {}});
+        target = targets.end() - 1;
+      }
+      target->rules.Add(rule);
+    }
+    return targets;
+  }();
+  return targets;
+}
+
+// The target that `path` opens, -1 if none, and its file name in lower case
+// in `name`.
+int FindPakTarget(const wchar_t* path, std::wstring* name) {
+  std::wstring lower = path;
+  std::transform(lower.begin(), lower.end(), lower.begin(), ::towlower);
+  size_t slash = lower.find_last_of(L"\\/");
+  *name = slash == std::wstring::npos ? lower : lower.substr(slash + 1);
+  bool in_locales =
+      slash != std::wstring::npos &&
+      isEndWith(lower.substr(0, slash).c_str(), L"locales") &&
+      (slash == 7 || lower[slash - 8] == L'\\' || lower[slash - 8] == L'/');
+
+  const auto& targets = GetPakTargets();
+  for (size_t i = 0; i < targets.size(); ++i) {
+    const std::string& pak = targets[i].pak;
+    if (pak == "locale" ? in_locales
+                        : std::wstring(pak.begin(), pak.end()) == *name) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+// What the rules produce, so that a change of the rules or of Chrome++
+// invalidates everything derived from them.
+uint64_t HashPakRules(const PakRuleSet& rules) {
+  uint64_t hash = HashBytes(RELEASE_VER_STR, sizeof(RELEASE_VER_STR) - 1);
+  auto add = [&](const std::string& text) {
+    hash = HashBytes(text.c_str(), text.size() + 1, hash);
+  };
+  for (const auto& rule : rules.rules()) {
+    hash = HashBytes(&rule.id, sizeof(rule.id), hash);
+    add(rule.pak);
+    add(rule.marker);
+    add(rule.type);
+    add(rule.compress_html ? "1" : "0");
+    for (const auto& replacement : rule.replacements) {
+      add(replacement.search);
+      add(replacement.replace);
+    }
+  }
+  return hash;
+}
+
+// Only a few of thousands of resources are patched, so their IDs are
+// remembered per pak, in a section named after its file, and only those
+// entries are inflated on later launches. The pak is identified by its size,
+// a hash of its entry table and the rules.
+//
+// Returns the IDs of the patched resources.
+std::vector<uint16_t> PatchPak(const PakTarget& target,
+                               const std::wstring& name,
+                               uint8_t* buffer,
+                               size_t size) {
+  PakReader reader(buffer, size);
+  const PakRuleSet& rules = target.rules;
+  if (!reader.valid() || rules.empty())
+    return {};
+  const wchar_t* section = name.c_str();
+
+  uint64_t hash = HashBytes(reader.index(), reader.index_size());
+  auto identity = Format(L"%08X-%016llX-%016llX", (DWORD)size,
+                         (unsigned long long)hash,
+                         (unsigned long long)HashPakRules(rules));
+  auto patch = [&](uint16_t id, uint8_t* data, uint32_t length,
+                   uint32_t& new_len) {
+    return PatchResource(rules, id, data, length, new_len);
+  };
+
+  // Entries patched from the cache are left alone by the full scan, patching
+  // them twice could apply a replacement to its own output.
+  std::vector<uint16_t> patched;
+  wchar_t cached[64];
+  ::GetPrivateProfileStringW(section, L"identity", L"", cached,
+                             (DWORD)std::size(cached), kCachePath.c_str());
+  if (identity == cached) {
+    // The list is as long as the rules make it, the buffer grows until the
+    // whole of it fits.
+    std::vector<wchar_t> buffer(1024);
+    DWORD length;
+    while ((length = ::GetPrivateProfileStringW(
+                section, L"patched", L"", buffer.data(), (DWORD)buffer.size(),
+                kCachePath.c_str())) >= buffer.size() - 1) {
+      buffer.resize(buffer.size() * 2);
+    }
+    std::wstring ids(buffer.data(), length);
+    bool complete = !ids.empty();
+    PakPatchArena arena;
+    for (std::wstring_view id : Tokenizer<wchar_t>(ids, L',')) {
+      PakResource resource;
+      auto select = [](const PakResource&) { return true; };
+      // The ID is followed by a comma or the end of `ids`.
+      if (reader.FindById((uint16_t)wcstoul(id.data(), nullptr, 10),
+                          &resource) &&
+          PatchPakEntry(resource, select, patch, arena)) {
+        patched.push_back(resource.id);
+      } else {
+        complete = false;
+      }
+    }
+    if (complete)
+      return patched;
+    DebugLog(L"Cached pak resources %s are stale", ids.c_str());
+  }
+
+  // Traverse the gzip and brotli resources.
+  size_t targets = rules.target_count();
+  auto rest = TraversalGZIPFile(
+      reader,
+      [&](const PakResource& resource) {
+        return std::find(patched.begin(), patched.end(), resource.id) ==
+                   patched.end() &&
+               rules.Selects(resource);
+      },
+      patch, targets > patched.size() ? targets - patched.size() : 0);
+  patched.insert(patched.end(), rest.begin(), rest.end());
+
+  std::wstring ids;
+  for (uint16_t id : patched) {
+    ids += (ids.empty() ? L"" : L",") + std::to_wstring(id);
+  }
+  ::WritePrivateProfileStringW(section, nullptr, nullptr, kCachePath.c_str());
+  if (!patched.empty()) {
+    ::WritePrivateProfileStringW(section, L"identity", identity.c_str(),
+                                 kCachePath.c_str());
+    ::WritePrivateProfileStringW(section, L"patched", ids.c_str(),
+                                 kCachePath.c_str());
+  }
+  return patched;
+}
+
+// Patched paks are written once and opened instead of the original on later
+// launches, so Chrome maps a clean read-only file whose pages are shared and
+// nothing is patched at startup.
+const std::wstring kPakCacheDir = GetAppDir() + L"\\chrome++_cache";
+
+// Copies of the pak `name` in the cache, for FindFirstFile.
+std::wstring GetPatchedPakPattern(const std::wstring& name) {
+  return Format(L"%s\\%s-????????-????????????????-????????????????.pak",
+                kPakCacheDir.c_str(), name.substr(0, name.size() - 4).c_str());
+}
+
+// The patched copy of the pak `name` open as `file`. It is named after the
+// pak, its size, the last write time and a hash of the entry table of the pak
+// and of the rules, so an update of Chrome, of Chrome++ or of the rules leads
+// to a new copy. Empty if the file is not a pak.
+std::wstring GetPatchedPakPath(const PakTarget& target,
+                               const std::wstring& name,
+                               HANDLE file) {
+  BY_HANDLE_FILE_INFORMATION info;
+  if (!::GetFileInformationByHandle(file, &info) || info.nFileSizeHigh)
+    return L"";
+
+  HANDLE map =
+      RawCreateFileMapping(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!map)
+    return L"";
+  uint8_t* view = (uint8_t*)RawMapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+  uint64_t hash = 0;
+  if (view) {
+    PakReader reader(view, info.nFileSizeLow);
+    if (reader.valid()) {
+      hash = HashBytes(reader.index(), reader.index_size());
+      hash ^= HashPakRules(target.rules);
+      // Rebuilt paks may hold patches an in-place one had to leave out.
+      if (IsPakRebuild())
+        hash = HashBytes("rebuild", 7, hash);
+    }
+    ::UnmapViewOfFile(view);
+  }
+  ::CloseHandle(map);
+  if (!hash)
+    return L"";
+
+  return Format(L"%s\\%s-%08X-%08X%08X-%016llX.pak", kPakCacheDir.c_str(),
+                name.substr(0, name.size() - 4).c_str(), info.nFileSizeLow,
+                info.ftLastWriteTime.dwHighDateTime,
+                info.ftLastWriteTime.dwLowDateTime, (unsigned long long)hash);
+}
+
+bool WriteFileFully(HANDLE file, const uint8_t* data, size_t size) {
+  while (size) {
+    DWORD chunk = (DWORD)(std::min)(size, (size_t)1 << 30);
+    DWORD written = 0;
+    if (!::WriteFile(file, data, chunk, &written, nullptr) || written != chunk)
+      return false;
+    data += chunk;
+    size -= chunk;
+  }
+  return true;
+}
+
+// Save a copy of the pak `name` to `path` in the cache, with write(file)
+// writing its content. The copy is written to a temporary file and renamed,
+// so a pak in the cache is always complete.
+template <typename Function>
+bool SavePakToCache(const std::wstring& name,
+                    const std::wstring& path,
+                    Function write) {
+  ::CreateDirectoryW(kPakCacheDir.c_str(), nullptr);
+
+  // Copies of older versions of the pak. Ones still open in a running
+  // browser stay.
+  auto pattern = GetPatchedPakPattern(name);
+  WIN32_FIND_DATAW find_data;
+  HANDLE find = ::FindFirstFileW(pattern.c_str(), &find_data);
+  if (find != INVALID_HANDLE_VALUE) {
+    do {
+      ::DeleteFileW((kPakCacheDir + L"\\" + find_data.cFileName).c_str());
+    } while (::FindNextFileW(find, &find_data));
+    ::FindClose(find);
+  }
+
+  auto temp_path = Format(L"%s.%u.tmp", path.c_str(), GetCurrentProcessId());
+  HANDLE file = RawCreateFile(temp_path.c_str(), GENERIC_WRITE, 0, nullptr,
+                              CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    DebugLog(L"Create %s failed %d", temp_path.c_str(), GetLastError());
+    return false;
+  }
+  bool ok = write(file);
+  ::CloseHandle(file);
+  if (!ok || !::MoveFileExW(temp_path.c_str(), path.c_str(),
+                            MOVEFILE_REPLACE_EXISTING |
+                                MOVEFILE_WRITE_THROUGH)) {
+    DebugLog(L"Save %s failed %d", path.c_str(), GetLastError());
+    ::DeleteFileW(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Write the patched view of the pak `name` to `path` in the background. The
+// view is copied first, Chrome may unmap it any time after this returns, as
+// it does with the locale pak when the language changes.
+void SavePatchedPak(std::wstring name,
+                    const uint8_t* buffer,
+                    size_t size,
+                    std::wstring path) {
+  std::vector<uint8_t> copy(buffer, buffer + size);
+  std::thread([name, path, data = std::move(copy)]() {
+    SavePakToCache(name, path, [&](HANDLE file) {
+      return WriteFileFully(file, data.data(), data.size());
+    });
+  }).detach();
+}
+
+// Write the pak `name` open as `file` with the rules of `target` applied out
+// of place to `path`, where patched resources may grow. This costs a full
+// pass over the pak once, later launches open the copy directly. Returns
+// false if nothing was patched or the copy could not be written.
+bool RebuildPak(const PakTarget& target,
+                const std::wstring& name,
+                HANDLE file,
+                const std::wstring& path) {
+  DWORD size = GetFileSize(file, nullptr);
+  HANDLE map =
+      RawCreateFileMapping(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!map)
+    return false;
+  uint8_t* view = (uint8_t*)RawMapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+  bool saved = false;
+  if (view) {
+    PakReader reader(view, size);
+    const PakRuleSet& rules = target.rules;
+    if (reader.valid() && !rules.empty()) {
+      std::vector<std::vector<uint8_t>> rebuilt;
+      auto patched = RebuildGZIPFile(
+          reader,
+          [&](const PakResource& resource) { return rules.Selects(resource); },
+          [&](uint16_t id, uint8_t* data, uint32_t length, uint32_t& new_len) {
+            return PatchResource(rules, id, data, length, new_len);
+          },
+          &rebuilt, rules.target_count());
+      saved = !patched.empty() && SavePakToCache(name, path, [&](HANDLE out) {
+        return WriteRebuiltPak(
+            reader, rebuilt, [&](const uint8_t* data, size_t length) {
+              return WriteFileFully(out, data, length);
+            });
+      });
+    }
+    ::UnmapViewOfFile(view);
+  }
+  ::CloseHandle(map);
+  return saved;
+}
+
+#ifndef MEM_RESERVE_PLACEHOLDER
+#define MEM_RESERVE_PLACEHOLDER 0x00040000
+#define MEM_REPLACE_PLACEHOLDER 0x00004000
+#define MEM_PRESERVE_PLACEHOLDER 0x00000002
+#endif
+
+// VirtualAlloc2 and MapViewOfFile3, Windows 10 1803 and later.
+typedef PVOID(WINAPI* VirtualAlloc2Function)(HANDLE process,
+                                             PVOID address,
+                                             SIZE_T size,
+                                             ULONG type,
+                                             ULONG protect,
+                                             void* parameters,
+                                             ULONG count);
+typedef PVOID(WINAPI* MapViewOfFile3Function)(HANDLE mapping,
+                                              HANDLE process,
+                                              PVOID address,
+                                              ULONG64 offset,
+                                              SIZE_T size,
+                                              ULONG type,
+                                              ULONG protect,
+                                              void* parameters,
+                                              ULONG count);
+
+// Map the `size` bytes of the pak behind `map` read-only and shared, except
+// for the chunks holding `pages` of the patched view at `patched`, which are
+// copied into private memory. A copy-on-write view of the whole pak is
+// charged against the commit limit in full and any page of it can still be
+// privatized; here only the private chunks are. Placeholders are split at the
+// allocation granularity, so chunks are 64 KB, and the last one is private
+// when the pak ends inside it because a view cannot reach past the file.
+// The pieces are never unmapped, which only suits a pak Chrome keeps mapped
+// until exit: it unmaps a locale pak when it reloads the locale, and its
+// UnmapViewOfFile would release the first piece alone. Returns null if the
+// system lacks placeholders or any step fails.
+uint8_t* MapPakOverlay(HANDLE map,
+                       const uint8_t* patched,
+                       size_t size,
+                       const std::vector<size_t>& pages) {
+  static const auto virtual_alloc2 = (VirtualAlloc2Function)::GetProcAddress(
+      ::GetModuleHandleW(L"kernelbase.dll"), "VirtualAlloc2");
+  static const auto map_view_of_file3 =
+      (MapViewOfFile3Function)::GetProcAddress(
+          ::GetModuleHandleW(L"kernelbase.dll"), "MapViewOfFile3");
+  if (!virtual_alloc2 || !map_view_of_file3 || !size)
+    return nullptr;
+
+  SYSTEM_INFO info;
+  ::GetSystemInfo(&info);
+  size_t chunk = info.dwAllocationGranularity;
+  size_t chunk_count = (size + chunk - 1) / chunk;
+  std::vector<uint8_t> is_private(chunk_count, 0);
+  for (size_t page : pages) {
+    is_private[page / chunk] = 1;
+  }
+  if (size % chunk)
+    is_private.back() = 1;
+
+  uint8_t* base = (uint8_t*)virtual_alloc2(
+      nullptr, nullptr, chunk_count * chunk,
+      MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, nullptr, 0);
+  if (!base)
+    return nullptr;
+
+  // Each run of chunks of one kind is split off the front of the placeholder
+  // and replaced.
+  std::vector<std::pair<uint8_t*, bool>> runs;
+  bool ok = true;
+  for (size_t begin = 0, end; begin < chunk_count; begin = end) {
+    end = begin + 1;
+    while (end < chunk_count && is_private[end] == is_private[begin]) {
+      ++end;
+    }
+    uint8_t* address = base + begin * chunk;
+    size_t length = (end - begin) * chunk;
+    if (end < chunk_count &&
+        !::VirtualFree(address, length,
+                       MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER)) {
+      ::VirtualFree(address, 0, MEM_RELEASE);
+      ok = false;
+      break;
+    }
+
+    void* replaced;
+    if (is_private[begin]) {
+      replaced = virtual_alloc2(
+          nullptr, address, length,
+          MEM_RESERVE | MEM_COMMIT | MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE,
+          nullptr, 0);
+      if (replaced) {
+        memcpy(address, patched + begin * chunk,
+               (std::min)(length, size - begin * chunk));
+        DWORD protect;
+        ::VirtualProtect(address, length, PAGE_READONLY, &protect);
+      }
+    } else {
+      replaced = map_view_of_file3(map, ::GetCurrentProcess(), address,
+                                   begin * chunk, length,
+                                   MEM_REPLACE_PLACEHOLDER, PAGE_READONLY,
+                                   nullptr, 0);
+    }
+    if (!replaced) {
+      ::VirtualFree(address, 0, MEM_RELEASE);
+      if (end < chunk_count)
+        ::VirtualFree(base + end * chunk, 0, MEM_RELEASE);
+      ok = false;
+      break;
+    }
+    runs.push_back({address, is_private[begin] != 0});
+  }
+
+  if (!ok) {
+    DebugLog(L"Map pak overlay failed %d", GetLastError());
+    for (const auto& run : runs) {
+      if (run.second) {
+        ::VirtualFree(run.first, 0, MEM_RELEASE);
+      } else {
+        ::UnmapViewOfFile(run.first);
+      }
+    }
+    return nullptr;
+  }
+  return base;
+}
+
+// A pak opened by Chrome and not patched yet. Its handle is the file until
+// Chrome creates the mapping, then the mapping.
+struct InterceptedPak {
+  HANDLE handle;
+  bool mapped;
+  size_t target;
+  DWORD size;
+  std::wstring name;
+  std::wstring patched_path;
+};
+
+// Chrome's I/O threads open files concurrently, so the state of the hooks is
+// guarded by a lock. Every hooked call looks its handle up, which only takes
+// the lock shared.
+SRWLOCK intercepted_paks_lock = SRWLOCK_INIT;
+std::vector<InterceptedPak> intercepted_paks;
+
+// Each target is patched once, the hooks are removed once none is pending.
+std::vector<uint8_t> claimed_pak_targets;
+size_t pending_pak_targets = 0;
+
+// How long the hooks wait for the targets. Chrome loads its paks within the
+// first seconds, processes that never open them would keep the hooks for
+// good otherwise.
+constexpr DWORD kPakHookTimeout = 60 * 1000;
+HANDLE pak_hook_timer = nullptr;
+
+void AddInterceptedPak(InterceptedPak pak) {
+  ::AcquireSRWLockExclusive(&intercepted_paks_lock);
+  intercepted_paks.push_back(std::move(pak));
+  ::ReleaseSRWLockExclusive(&intercepted_paks_lock);
+}
+
+// Remove the pak with `handle` from the table into `pak`. Returns false if
+// there is none, which is every call but one per pak.
+bool TakeInterceptedPak(HANDLE handle, bool mapped, InterceptedPak* pak) {
+  auto matches = [&](const InterceptedPak& pak) {
+    return pak.handle == handle && pak.mapped == mapped;
+  };
+  ::AcquireSRWLockShared(&intercepted_paks_lock);
+  bool found = std::any_of(intercepted_paks.begin(), intercepted_paks.end(),
+                           matches);
+  ::ReleaseSRWLockShared(&intercepted_paks_lock);
+  if (!found)
+    return false;
+
+  // Another thread may have taken it in between.
+  ::AcquireSRWLockExclusive(&intercepted_paks_lock);
+  auto it =
+      std::find_if(intercepted_paks.begin(), intercepted_paks.end(), matches);
+  found = it != intercepted_paks.end();
+  if (found) {
+    *pak = std::move(*it);
+    intercepted_paks.erase(it);
+  }
+  ::ReleaseSRWLockExclusive(&intercepted_paks_lock);
+  return found;
+}
+
+// Returns true for the first caller only.
+bool ClaimPakTarget(size_t target) {
+  ::AcquireSRWLockExclusive(&intercepted_paks_lock);
+  bool claimed = !claimed_pak_targets[target];
+  claimed_pak_targets[target] = 1;
+  ::ReleaseSRWLockExclusive(&intercepted_paks_lock);
+  return claimed;
+}
+
+void FinishPakTarget(size_t target);
+
 HANDLE WINAPI MyMapViewOfFile(_In_ HANDLE hFileMappingObject,
                               _In_ DWORD dwDesiredAccess,
                               _In_ DWORD dwFileOffsetHigh,
                               _In_ DWORD dwFileOffsetLow,
                               _In_ SIZE_T dwNumberOfBytesToMap) {
-  if (hFileMappingObject == resources_pak_map) {
-    // Modify it to be modifiable.
-    LPVOID buffer =
-        RawMapViewOfFile(hFileMappingObject, FILE_MAP_COPY, dwFileOffsetHigh,
-                         dwFileOffsetLow, dwNumberOfBytesToMap);
-
-    // No more hook needed.
-    resources_pak_map = nullptr;
-    DetourTransactionBegin();
-    DetourUpdateThread(GetCurrentThread());
-    DetourDetach((LPVOID*)&RawMapViewOfFile, MyMapViewOfFile);
-    auto status = DetourTransactionCommit();
-    if (status != NO_ERROR) {
-      DebugLog(L"Unhook RawMapViewOfFile failed %d", status);
-    }
-
-    if (buffer) {
-      // Traverse the gzip file.
-      TraversalGZIPFile((BYTE*)buffer, [=](uint8_t* begin, uint32_t size,
-                                           uint32_t& new_len) {
-        bool changed = false;
-
-        BYTE search_start[] = R"(</settings-about-page>)";
-        uint8_t* pos =
-            memmem(begin, size, search_start, sizeof(search_start) - 1);
-        if (pos) {
-          // Compress the HTML for writing patch information.
-          std::string html((char*)begin, size);
-          compression_html(html);
-
-          // RemoveUpdateError
-          // if (IsNeedPortable())
-          {
-            ReplaceStringInPlace(html, R"(hidden="[[!showUpdateStatus_]]")",
-                                 R"(hidden="true")");
-            ReplaceStringInPlace(
-                html, R"(hidden="[[!shouldShowIcons_(showUpdateStatus_)]]")",
-                R"(hidden="true")");
-          }
-
-          const char prouct_title[] = u8R"({aboutBrowserVersion}</div><div class="secondary"><a target="_blank" href="https://github.com/Bush2021/chrome_plus">Chrome++</a> )" RELEASE_VER_STR u8R"( modified version</div>)";
-          ReplaceStringInPlace(html, R"({aboutBrowserVersion}</div>)",
-                               prouct_title);
-
-          if (html.length() <= size) {
-            // Write modifications.
-            memcpy(begin, html.c_str(), html.length());
-
-            // Modify length.
-            new_len = html.length();
-            changed = true;
-          }
-        }
+  InterceptedPak pak;
+  if (!TakeInterceptedPak(hFileMappingObject, true, &pak)) {
+    return RawMapViewOfFile(hFileMappingObject, dwDesiredAccess,
+                            dwFileOffsetHigh, dwFileOffsetLow,
+                            dwNumberOfBytesToMap);
+  }
 
-        return changed;
-      });
+  // Modify it to be modifiable.
+  LPVOID buffer =
+      RawMapViewOfFile(hFileMappingObject, FILE_MAP_COPY, dwFileOffsetHigh,
+                       dwFileOffsetLow, dwNumberOfBytesToMap);
+
+  std::vector<uint16_t> patched;
+  if (buffer) {
+    patched = PatchPak(GetPakTargets()[pak.target], pak.name,
+                       (uint8_t*)buffer, pak.size);
+  }
+
+  // The pages written to stay private for as long as the view is mapped.
+  PakReader reader((uint8_t*)buffer, pak.size);
+  auto pages = PakPatchedPages(reader, patched);
+  DebugLog(L"Patched %d resources on %d pages (%d KB) of %s",
+           (int)patched.size(), (int)pages.size(),
+           (int)(pages.size() * kPakPageSize / 1024), pak.name.c_str());
+
+  // The overlay replaces the copy-on-write view, which is only written to
+  // while patching. Only resources.pak stays mapped until exit, see
+  // MapPakOverlay().
+  bool whole_file = !dwFileOffsetHigh && !dwFileOffsetLow &&
+                    (!dwNumberOfBytesToMap || dwNumberOfBytesToMap == pak.size);
+  bool mapped_until_exit = GetPakTargets()[pak.target].pak == "resources.pak";
+  if (buffer && whole_file && mapped_until_exit && IsPakOverlay()) {
+    uint8_t* overlay =
+        MapPakOverlay(hFileMappingObject, (uint8_t*)buffer, pak.size, pages);
+    if (overlay) {
+      ::UnmapViewOfFile(buffer);
+      buffer = overlay;
     }
+  }
 
-    return buffer;
+  if (!patched.empty() && !pak.patched_path.empty()) {
+    SavePatchedPak(pak.name, (uint8_t*)buffer, pak.size, pak.patched_path);
   }
 
-  return RawMapViewOfFile(hFileMappingObject, dwDesiredAccess, dwFileOffsetHigh,
-                          dwFileOffsetLow, dwNumberOfBytesToMap);
+  FinishPakTarget(pak.target);
+  return buffer;
 }
 
 HANDLE WINAPI MyCreateFileMapping(_In_ HANDLE hFile,
@@ -87,34 +626,25 @@ HANDLE WINAPI MyCreateFileMapping(_In_ HANDLE hFile,
                                   _In_ DWORD dwMaximumSizeHigh,
                                   _In_ DWORD dwMaximumSizeLow,
                                   _In_opt_ LPCTSTR lpName) {
-  if (hFile == resources_pak_file) {
-    // Modify it to be modifiable.
-    resources_pak_map =
-        RawCreateFileMapping(hFile, lpAttributes, PAGE_WRITECOPY,
-                             dwMaximumSizeHigh, dwMaximumSizeLow, lpName);
-
-    // No more hook needed.
-    resources_pak_file = nullptr;
-    DetourTransactionBegin();
-    DetourUpdateThread(GetCurrentThread());
-    DetourDetach((LPVOID*)&RawCreateFileMapping, MyCreateFileMapping);
-    auto status = DetourTransactionCommit();
-    if (status != NO_ERROR) {
-      DebugLog(L"Unhook RawCreateFileMapping failed %d", status);
-    }
-
-    DetourTransactionBegin();
-    DetourUpdateThread(GetCurrentThread());
-    DetourAttach((LPVOID*)&RawMapViewOfFile, MyMapViewOfFile);
-    status = DetourTransactionCommit();
-    if (status != NO_ERROR) {
-      DebugLog(L"Hook RawMapViewOfFile failed %d", status);
-    }
+  InterceptedPak pak;
+  if (!TakeInterceptedPak(hFile, false, &pak)) {
+    return RawCreateFileMapping(hFile, lpAttributes, flProtect,
+                                dwMaximumSizeHigh, dwMaximumSizeLow, lpName);
+  }
 
-    return resources_pak_map;
+  // Modify it to be modifiable. Overlays are built from a read-only mapping,
+  // which still allows the copy-on-write view they are patched in.
+  HANDLE map = RawCreateFileMapping(
+      hFile, lpAttributes, IsPakOverlay() ? flProtect : PAGE_WRITECOPY,
+      dwMaximumSizeHigh, dwMaximumSizeLow, lpName);
+  if (map) {
+    pak.handle = map;
+    pak.mapped = true;
+    AddInterceptedPak(std::move(pak));
+  } else {
+    FinishPakTarget(pak.target);
   }
-  return RawCreateFileMapping(hFile, lpAttributes, flProtect, dwMaximumSizeHigh,
-                              dwMaximumSizeLow, lpName);
+  return map;
 }
 
 HANDLE WINAPI MyCreateFile(_In_ LPCTSTR lpFileName,
@@ -127,39 +657,161 @@ HANDLE WINAPI MyCreateFile(_In_ LPCTSTR lpFileName,
   HANDLE file = RawCreateFile(lpFileName, dwDesiredAccess, dwShareMode,
                               lpSecurityAttributes, dwCreationDisposition,
                               dwFlagsAndAttributes, hTemplateFile);
+  if (file == INVALID_HANDLE_VALUE || !isEndWith(lpFileName, L".pak"))
+    return file;
 
-  if (isEndWith(lpFileName, L"resources.pak")) {
-    resources_pak_file = file;
-    resources_pak_size = GetFileSize(resources_pak_file, nullptr);
+  std::wstring name;
+  int target = FindPakTarget(lpFileName, &name);
+  if (target < 0 || !ClaimPakTarget(target))
+    return file;
 
-    DetourTransactionBegin();
-    DetourUpdateThread(GetCurrentThread());
-    DetourAttach((LPVOID*)&RawCreateFileMapping, MyCreateFileMapping);
-    auto status = DetourTransactionCommit();
-    if (status != NO_ERROR) {
-      DebugLog(L"Hook RawCreateFileMapping failed %d", status);
+  const PakTarget& pak_target = GetPakTargets()[target];
+  std::wstring patched_path = GetPatchedPakPath(pak_target, name, file);
+  auto open_patched = [&]() {
+    return patched_path.empty()
+               ? INVALID_HANDLE_VALUE
+               : RawCreateFile(patched_path.c_str(), dwDesiredAccess,
+                               dwShareMode, lpSecurityAttributes,
+                               OPEN_EXISTING, dwFlagsAndAttributes,
+                               hTemplateFile);
+  };
+  HANDLE patched = open_patched();
+  if (patched == INVALID_HANDLE_VALUE && !patched_path.empty() &&
+      IsPakRebuild() && RebuildPak(pak_target, name, file, patched_path)) {
+    // Chrome gets the rebuilt pak from the start.
+    patched = open_patched();
+  }
+  if (patched != INVALID_HANDLE_VALUE) {
+    // Already patched, nothing to intercept.
+    ::CloseHandle(file);
+    FinishPakTarget(target);
+    return patched;
+  }
+
+  AddInterceptedPak({file, false, (size_t)target, GetFileSize(file, nullptr),
+                     name, patched_path});
+  return file;
+}
+
+// Open the other threads of the process. Chrome's I/O threads may be inside
+// a hooked call when the hooks are removed, from the timer thread as well, so
+// Detours has to move every one of them out of the code it restores.
+std::vector<HANDLE> OpenOtherThreads() {
+  std::vector<HANDLE> threads;
+  HANDLE snapshot = ::CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+  if (snapshot == INVALID_HANDLE_VALUE)
+    return threads;
+  THREADENTRY32 entry = {sizeof(entry)};
+  for (BOOL more = ::Thread32First(snapshot, &entry); more;
+       more = ::Thread32Next(snapshot, &entry)) {
+    if (entry.th32OwnerProcessID != ::GetCurrentProcessId() ||
+        entry.th32ThreadID == ::GetCurrentThreadId()) {
+      continue;
     }
+    HANDLE thread = ::OpenThread(
+        THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_SET_CONTEXT, FALSE,
+        entry.th32ThreadID);
+    if (thread)
+      threads.push_back(thread);
+  }
+  ::CloseHandle(snapshot);
+  return threads;
+}
+
+// Remove the hooks, so that later file I/O goes straight to the system. Runs
+// once, on the thread that finished the last target or on the timer thread.
+void UnhookPakFiles() {
+  if (pak_hook_timer) {
+    // Does not wait, the callback may be the caller.
+    ::DeleteTimerQueueTimer(nullptr, pak_hook_timer, nullptr);
+    pak_hook_timer = nullptr;
+  }
 
-    // No more hook needed.
-    DetourTransactionBegin();
-    DetourUpdateThread(GetCurrentThread());
-    DetourDetach((LPVOID*)&RawCreateFile, MyCreateFile);
-    status = DetourTransactionCommit();
-    if (status != NO_ERROR) {
-      DebugLog(L"Unhook RawCreateFile failed %d", status);
+  auto threads = OpenOtherThreads();
+  DetourTransactionBegin();
+  DetourUpdateThread(GetCurrentThread());
+  for (HANDLE thread : threads) {
+    DetourUpdateThread(thread);
+  }
+  DetourDetach((LPVOID*)&RawCreateFile, MyCreateFile);
+  DetourDetach((LPVOID*)&RawCreateFileMapping, MyCreateFileMapping);
+  DetourDetach((LPVOID*)&RawMapViewOfFile, MyMapViewOfFile);
+  auto status = DetourTransactionCommit();
+  if (status != NO_ERROR) {
+    DebugLog(L"Unhook pak files failed %d", status);
+  }
+  for (HANDLE thread : threads) {
+    ::CloseHandle(thread);
+  }
+}
+
+// Count `target` as patched or failed. Chrome opens resources.pak after the
+// locale and the other paks it loads at startup, so once it is done the
+// targets not opened yet are given up on. The hooks are removed when the
+// last pending target finishes.
+void FinishPakTarget(size_t target) {
+  bool startup_done = GetPakTargets()[target].pak == "resources.pak";
+  ::AcquireSRWLockExclusive(&intercepted_paks_lock);
+  bool was_pending = pending_pak_targets > 0;
+  if (was_pending)
+    --pending_pak_targets;
+  if (startup_done) {
+    for (auto& claimed : claimed_pak_targets) {
+      if (!claimed) {
+        claimed = 1;
+        --pending_pak_targets;
+      }
     }
   }
+  bool finished = was_pending && pending_pak_targets == 0;
+  ::ReleaseSRWLockExclusive(&intercepted_paks_lock);
+  if (finished)
+    UnhookPakFiles();
+}
 
-  return file;
+// Give up on every target still pending once kPakHookTimeout has passed,
+// opened or not. A pak opened but not mapped yet is then left unpatched.
+VOID CALLBACK AbandonPakTargets(PVOID, BOOLEAN) {
+  ::AcquireSRWLockExclusive(&intercepted_paks_lock);
+  bool finished = pending_pak_targets > 0;
+  pending_pak_targets = 0;
+  std::fill(claimed_pak_targets.begin(), claimed_pak_targets.end(), 1);
+  intercepted_paks.clear();
+  ::ReleaseSRWLockExclusive(&intercepted_paks_lock);
+  if (finished) {
+    DebugLog(L"Pak targets not opened in %d ms", kPakHookTimeout);
+    UnhookPakFiles();
+  }
 }
 
 void PakPatch() {
+  const auto& targets = GetPakTargets();
+  if (targets.empty())
+    return;
+  claimed_pak_targets.assign(targets.size(), 0);
+  pending_pak_targets = targets.size();
+
+  // Armed before the hooks, so the handle is set by the time a hooked call
+  // can finish the last target and delete it.
+  if (!::CreateTimerQueueTimer(&pak_hook_timer, nullptr, AbandonPakTargets,
+                               nullptr, kPakHookTimeout, 0,
+                               WT_EXECUTEONLYONCE)) {
+    DebugLog(L"Create pak hook timer failed %d", GetLastError());
+    pak_hook_timer = nullptr;
+  }
+
   DetourTransactionBegin();
   DetourUpdateThread(GetCurrentThread());
   DetourAttach((LPVOID*)&RawCreateFile, MyCreateFile);
+  DetourAttach((LPVOID*)&RawCreateFileMapping, MyCreateFileMapping);
+  DetourAttach((LPVOID*)&RawMapViewOfFile, MyMapViewOfFile);
   auto status = DetourTransactionCommit();
   if (status != NO_ERROR) {
-    DebugLog(L"Hook RawCreateFile failed %d", status);
+    DebugLog(L"Hook pak files failed %d", status);
+    if (pak_hook_timer) {
+      ::DeleteTimerQueueTimer(nullptr, pak_hook_timer, INVALID_HANDLE_VALUE);
+      pak_hook_timer = nullptr;
+    }
   }
 }
 
@@ -0,0 +1,390 @@
+#ifndef PAKRULES_H_
+#define PAKRULES_H_
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "multisearch.h"
+#include "pakfile.h"
+#include "textutils.h"
+
+struct PakReplacement {
+  std::string search;
+  std::string replace;
+};
+
+// Selects resources and says how to patch them. A rule applies to a resource
+// when every selector it has matches: the resource ID, a marker the content
+// contains, and the content type as sniffed by PakResourceType().
+struct PakRule {
+  std::string name;
+
+  // The pak file the rule patches, in lower case, or "locale" for the pak of
+  // the locales directory that Chrome loads.
+  std::string pak = "resources.pak";
+
+  uint16_t id = 0;
+  std::string marker;
+  std::string type;
+
+  // Collapse the HTML with compression_html() before replacing.
+  bool compress_html = false;
+
+  std::vector<PakReplacement> replacements;
+};
+
+// "html", "svg", "json" or "text", from the first non-blank byte.
+const char* PakResourceType(const uint8_t* data, size_t size) {
+  size_t i = 0;
+  while (i < size && (data[i] == ' ' || data[i] == '\t' || data[i] == '\r' ||
+                      data[i] == '\n')) {
+    ++i;
+  }
+  if (i == size)
+    return "text";
+  if (data[i] == '{' || data[i] == '[')
+    return "json";
+  if (data[i] != '<')
+    return "text";
+  if (size - i >= 4 && (!memcmp(data + i, "<svg", 4) ||
+                        (size - i >= 5 && !memcmp(data + i, "<?xml", 5)))) {
+    return "svg";
+  }
+  return "html";
+}
+
+// A set of rules applied together. All replacements of the rules that apply
+// to a resource are found in one scan and written into one output buffer, so
+// more rules cost more patterns, not more passes over the content.
+class PakRuleSet {
+ public:
+  void Add(PakRule rule) { rules_.push_back(std::move(rule)); }
+
+  bool empty() const { return rules_.empty(); }
+  const std::vector<PakRule>& rules() const { return rules_; }
+
+  // How many resources the rules can rewrite at most, 0 if unknown. Only
+  // rules that all select by ID bound it; a marker or a type may match any
+  // number of resources, and stopping at the first would make the result
+  // depend on which worker finds one first.
+  size_t target_count() const {
+    std::vector<uint16_t> ids;
+    for (const auto& rule : rules_) {
+      if (!rule.id)
+        return 0;
+      ids.push_back(rule.id);
+    }
+    std::sort(ids.begin(), ids.end());
+    return std::unique(ids.begin(), ids.end()) - ids.begin();
+  }
+
+  // Whether any rule may apply to the gzip or brotli resource, looking only
+  // as far into its content as needed.
+  bool Selects(const PakResource& resource) const {
+    bool needs_content = false;
+    size_t overlap = 0;
+    for (const auto& rule : rules_) {
+      if (rule.id && rule.id != resource.id)
+        continue;
+      if (rule.marker.empty() && rule.type.empty())
+        return true;
+      needs_content = true;
+      if (!rule.marker.empty())
+        overlap = (std::max)(overlap, rule.marker.size() - 1);
+    }
+    if (!needs_content)
+      return false;
+
+    // The type comes from the start of the content, markers can be anywhere.
+    std::vector<uint8_t> pending(rules_.size(), 0);
+    for (size_t i = 0; i < rules_.size(); ++i) {
+      pending[i] = !rules_[i].id || rules_[i].id == resource.id;
+    }
+    bool first = true;
+    bool selected = false;
+    PakStream(resource, overlap,
+              [&](const uint8_t* window, size_t length) {
+                bool any_pending = false;
+                for (size_t i = 0; i < rules_.size(); ++i) {
+                  if (!pending[i])
+                    continue;
+                  const PakRule& rule = rules_[i];
+                  if (first && !rule.type.empty() &&
+                      rule.type != PakResourceType(window, length)) {
+                    pending[i] = 0;
+                    continue;
+                  }
+                  if (rule.marker.empty() ||
+                      SearchBytes(window, length,
+                                  (const uint8_t*)rule.marker.data(),
+                                  rule.marker.size())) {
+                    selected = true;
+                    return true;
+                  }
+                  any_pending = true;
+                }
+                first = false;
+                // Stop early once no rule can apply any more.
+                return !any_pending;
+              });
+    return selected;
+  }
+
+  // Apply the rules that match resource `id` to its content. Returns true
+  // and the patched content in `out` if anything changed.
+  //
+  // Replacements are matched against the content as it was, not as earlier
+  // replacements left it. Where matches overlap, the leftmost wins, and
+  // among those starting at the same place, the one listed first.
+  bool Apply(uint16_t id,
+             const uint8_t* data,
+             size_t size,
+             std::string* out) const {
+    std::vector<const PakRule*> matched;
+    bool compress = false;
+    for (const auto& rule : rules_) {
+      if (rule.id && rule.id != id)
+        continue;
+      if (!rule.type.empty() && rule.type != PakResourceType(data, size))
+        continue;
+      if (!rule.marker.empty() &&
+          !SearchBytes(data, size, (const uint8_t*)rule.marker.data(),
+                       rule.marker.size())) {
+        continue;
+      }
+      matched.push_back(&rule);
+      compress |= rule.compress_html;
+    }
+    if (matched.empty())
+      return false;
+
+    std::string content;
+    if (compress) {
+      content.resize(size + 1);
+      content.resize(CompressHtml(data, size, (uint8_t*)&content[0]));
+    } else {
+      content.assign((const char*)data, size);
+    }
+
+    MultiPatternScanner scanner;
+    std::vector<const PakReplacement*> replacements;
+    for (const PakRule* rule : matched) {
+      for (const auto& replacement : rule->replacements) {
+        scanner.Add(ExactPattern((const uint8_t*)replacement.search.data(),
+                                 replacement.search.size()));
+        replacements.push_back(&replacement);
+      }
+    }
+    const uint8_t* begin = (const uint8_t*)content.data();
+    scanner.Scan(begin, content.size());
+
+    struct Match {
+      size_t pos;
+      size_t index;
+    };
+    std::vector<Match> matches;
+    for (size_t i = 0; i < replacements.size(); ++i) {
+      for (const uint8_t* match : scanner.matches(i)) {
+        matches.push_back({(size_t)(match - begin), i});
+      }
+    }
+    std::sort(matches.begin(), matches.end(),
+              [](const Match& a, const Match& b) {
+                return a.pos != b.pos ? a.pos < b.pos : a.index < b.index;
+              });
+
+    out->clear();
+    out->reserve(content.size());
+    size_t done = 0;
+    for (const Match& match : matches) {
+      if (match.pos < done)
+        continue;
+      const PakReplacement* replacement = replacements[match.index];
+      out->append(content, done, match.pos - done);
+      out->append(replacement->replace);
+      done = match.pos + replacement->search.size();
+    }
+    out->append(content, done, std::string::npos);
+    return compress || !matches.empty();
+  }
+
+ private:
+  std::vector<PakRule> rules_;
+};
+
+// Apply the rules to the `size` bytes at `begin`, which has room for
+// `new_len` bytes, and set new_len to the patched size.
+bool PatchResource(const PakRuleSet& rules,
+                   uint16_t id,
+                   uint8_t* begin,
+                   uint32_t size,
+                   uint32_t& new_len) {
+  std::string patched;
+  if (!rules.Apply(id, begin, size, &patched))
+    return false;
+
+  if (patched.length() > new_len) {
+    DebugLog(L"Patched resource %d grew from %d to %d", id, size,
+             (int)patched.length());
+    return false;
+  }
+
+  // Write modifications.
+  memcpy(begin, patched.c_str(), patched.length());
+
+  // Modify length.
+  new_len = (uint32_t)patched.length();
+  return true;
+}
+
+// Values may use \n, \r, \t, \s for a space and \\ for a backslash, so that
+// leading and trailing blanks and line breaks can be written.
+std::string UnescapePakRuleValue(const std::string& value) {
+  std::string result;
+  for (size_t i = 0; i < value.size(); ++i) {
+    if (value[i] != '\\' || i + 1 == value.size()) {
+      result += value[i];
+      continue;
+    }
+    switch (value[++i]) {
+      case 'n':
+        result += '\n';
+        break;
+      case 'r':
+        result += '\r';
+        break;
+      case 't':
+        result += '\t';
+        break;
+      case 's':
+        result += ' ';
+        break;
+      default:
+        result += value[i];
+        break;
+    }
+  }
+  return result;
+}
+
+// Parse rules written as UTF-8 INI sections, one per rule:
+//
+//   [about page]
+//   marker=</settings-about-page>
+//   type=html
+//   compress_html=1
+//   search=hidden="[[!showUpdateStatus_]]"
+//   replace=hidden="true"
+//
+// id, marker and type select resources, each search is followed by its
+// replace. pak names the file patched, resources.pak by default. Lines
+// starting with ';' or '#' are comments.
+bool ParsePakRules(const std::string& text,
+                   PakRuleSet* rules,
+                   std::string* error) {
+  std::vector<PakRule> parsed;
+  bool has_search = false;
+  size_t line_number = 0;
+  auto fail = [&](const char* message) {
+    *error = "line " + std::to_string(line_number) + ": " + message;
+    return false;
+  };
+  auto finish = [&]() {
+    if (parsed.empty())
+      return true;
+    const PakRule& rule = parsed.back();
+    if (has_search)
+      return fail("search without replace");
+    if (!rule.id && rule.marker.empty() && rule.type.empty())
+      return fail("rule without id, marker or type");
+    return true;
+  };
+
+  size_t start = 0;
+  while (start <= text.size()) {
+    size_t end = text.find('\n', start);
+    if (end == std::string::npos)
+      end = text.size();
+    std::string line = text.substr(start, end - start);
+    start = end + 1;
+    ++line_number;
+
+    if (line_number == 1 && line.compare(0, 3, "\xEF\xBB\xBF") == 0)
+      line.erase(0, 3);
+    trim(line);
+    if (line.empty() || line[0] == ';' || line[0] == '#')
+      continue;
+
+    if (line[0] == '[') {
+      if (line.back() != ']')
+        return fail("unterminated section");
+      if (!finish())
+        return false;
+      parsed.emplace_back();
+      parsed.back().name = line.substr(1, line.size() - 2);
+      has_search = false;
+      continue;
+    }
+
+    size_t equals = line.find('=');
+    if (equals == std::string::npos)
+      return fail("expected key=value");
+    if (parsed.empty())
+      return fail("key outside of a rule");
+    std::string key = line.substr(0, equals);
+    std::string value = line.substr(equals + 1);
+    trim(key);
+    trim(value);
+    value = UnescapePakRuleValue(value);
+
+    PakRule& rule = parsed.back();
+    if (key == "pak") {
+      if (value.empty())
+        return fail("empty pak");
+      std::transform(value.begin(), value.end(), value.begin(),
+                     [](unsigned char c) { return (char)tolower(c); });
+      rule.pak = value;
+    } else if (key == "id") {
+      unsigned long id = strtoul(value.c_str(), nullptr, 0);
+      if (!id || id > 0xFFFF)
+        return fail("invalid id");
+      rule.id = (uint16_t)id;
+    } else if (key == "marker") {
+      rule.marker = value;
+    } else if (key == "type") {
+      rule.type = value;
+    } else if (key == "compress_html") {
+      rule.compress_html = value == "1";
+    } else if (key == "search") {
+      if (has_search)
+        return fail("search without replace");
+      if (value.empty())
+        return fail("empty search");
+      rule.replacements.push_back({value, ""});
+      has_search = true;
+    } else if (key == "replace") {
+      if (!has_search)
+        return fail("replace without search");
+      rule.replacements.back().replace = value;
+      has_search = false;
+    } else {
+      return fail("unknown key");
+    }
+  }
+  if (!finish())
+    return false;
+
+  for (auto& rule : parsed) {
+    rules->Add(std::move(rule));
+  }
+  return true;
+}
+
+#endif  // PAKRULES_H_
@@ -0,0 +1,120 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "signature.h"
+
+// Workers for startup scans and pak patching. The calling thread always takes
+// part, so a single worker means no extra thread at all.
+size_t DefaultWorkerCount() {
+  size_t cores = std::thread::hardware_concurrency();
+  return std::clamp<size_t>(cores, 1, 8);
+}
+
+// Run task(i) for every i in [0, count) on up to `workers` threads. Indices
+// are handed out in increasing order. Threads are created per call and
+// joined before returning, so this must not run under the loader lock.
+template <typename Function>
+void ParallelFor(size_t count, size_t workers, Function task) {
+  std::atomic<size_t> next{0};
+  auto run = [&]() {
+    for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;)
+      task(i);
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < workers && t < count; ++t) {
+    threads.emplace_back(run);
+  }
+  run();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// Chunks are sized to stay in L2 while the kernel streams over them.
+constexpr size_t kSearchChunkSize = 256 * 1024;
+
+// Inputs below this are faster to scan than to hand out.
+constexpr size_t kParallelSearchThreshold = 4 * 1024 * 1024;
+
+// Split [s, s + n) into chunks that overlap by (m - 1) bytes so that every
+// match starts in exactly one chunk, and scan them in parallel with
+// search(begin, length). Returns the lowest-address match, the same one a
+// serial scan finds. Chunks after the earliest confirmed match are skipped.
+template <typename Search>
+const uint8_t* ParallelChunkSearch(const uint8_t* s,
+                                   size_t n,
+                                   size_t m,
+                                   Search search,
+                                   size_t workers = DefaultWorkerCount()) {
+  if (!s || n < m)
+    return nullptr;
+  if (m == 0)
+    return s;
+
+  size_t starts = n - m + 1;
+  size_t chunks = (starts + kSearchChunkSize - 1) / kSearchChunkSize;
+  if (workers <= 1 || n < kParallelSearchThreshold || chunks < 2)
+    return search(s, n);
+
+  std::atomic<size_t> best_chunk{chunks};
+  std::vector<const uint8_t*> found(chunks, nullptr);
+  ParallelFor(chunks, workers, [&](size_t chunk) {
+    if (chunk > best_chunk.load(std::memory_order_relaxed))
+      return;
+
+    size_t begin = chunk * kSearchChunkSize;
+    size_t length = (std::min)(kSearchChunkSize, starts - begin) + m - 1;
+    const uint8_t* hit = search(s + begin, length);
+    if (!hit)
+      return;
+
+    found[chunk] = hit;
+    size_t current = best_chunk.load(std::memory_order_relaxed);
+    while (chunk < current &&
+           !best_chunk.compare_exchange_weak(current, chunk,
+                                             std::memory_order_relaxed)) {
+    }
+  });
+
+  // Every chunk before the best one ran to completion without a match.
+  size_t best = best_chunk.load();
+  return best < chunks ? found[best] : nullptr;
+}
+
+const uint8_t* ParallelSearch(const uint8_t* s,
+                              size_t n,
+                              const uint8_t* p,
+                              size_t m,
+                              size_t workers = DefaultWorkerCount()) {
+  if (!p)
+    return nullptr;
+  return ParallelChunkSearch(
+      s, n, m,
+      [=](const uint8_t* begin, size_t length) {
+        return SearchBytes(begin, length, p, m);
+      },
+      workers);
+}
+
+const uint8_t* ParallelPatternSearch(const uint8_t* s,
+                                     size_t n,
+                                     const PatternView& pattern,
+                                     size_t workers = DefaultWorkerCount()) {
+  return ParallelChunkSearch(
+      s, n, pattern.size,
+      [&](const uint8_t* begin, size_t length) {
+        return PatternSearch(begin, length, pattern);
+      },
+      workers);
+}
+
+#endif  // PARALLEL_H_
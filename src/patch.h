@@ -1,6 +1,8 @@
 #ifndef PATCH_H_
 #define PATCH_H_
 
+#include <iterator>
+
 typedef LONG NTSTATUS, *PNTSTATUS;
 
 #ifndef NT_SUCCESS
@@ -21,26 +23,82 @@ typedef NTSTATUS(WINAPI* pLdrLoadDll)(IN PWCHAR PathToFile OPTIONAL,
 
 pLdrLoadDll RawLdrLoadDll = nullptr;
 
+// A hard patch: a signature in the code section of chrome.dll and what to
+// do with its first match.
+struct CodePatch {
+  const wchar_t* name;
+  PatternView pattern;
+  void (*apply)(uint8_t* match);
+};
+
 // https://source.chromium.org/chromium/chromium/src/+/main:chrome/browser/ui/dialogs/outdated_upgrade_bubble.cc?q=outdated_upgrade_bubble&ss=chromium%2Fchromium%2Fsrc
-// This function is invalid and needs to be modified.
-// void Outdated(HMODULE module) {
-//   // "OutdatedUpgradeBubble.Show"
-// #ifdef _WIN64
-//   BYTE search[] = {0x48, 0x89, 0x8C, 0x24, 0xF0, 0x00, 0x00, 0x00, 0x80,
-//   0x3D}; uint8_t* match = SearchModuleRaw(module, search, sizeof(search));
-// #else
-//   BYTE search[] = {0x31, 0xE8, 0x89, 0x45, 0xF0, 0x88, 0x5D, 0xEF, 0x80,
-//   0x3D}; uint8_t* match = SearchModuleRaw(module, search, sizeof(search));
-// #endif
-//   if (match) {
-//     if (*(match + 0xF) == 0x74) {
-//       BYTE patch[] = {0x90, 0x90};
-//       WriteMemory(match + 0xF, patch, sizeof(patch));
-//     }
-//   } else {
-//     DebugLog(L"patch Outdated failed %p", module);
-//   }
-// }
+// "OutdatedUpgradeBubble.Show"
+// A spilled argument, then cmp byte ptr [flag], imm8 and the jz that skips
+// the bubble, which is turned into two NOPs. The stack slot and the address
+// of the flag change between builds, so they are wildcards; the jz is part
+// of the signature so that only a matched jump is ever written.
+#ifdef _WIN64
+constexpr auto kOutdatedPattern =
+    ParsePattern("48 89 8C 24 ?? 00 00 00 80 3D ?? ?? ?? ?? ?? 74 ??");
+#else
+constexpr auto kOutdatedPattern =
+    ParsePattern("31 E8 89 45 ?? 88 5D ?? 80 3D ?? ?? ?? ?? ?? 74 ??");
+#endif
+
+// Where the jz starts in kOutdatedPattern.
+constexpr size_t kOutdatedJump = 15;
+static_assert(kOutdatedPattern.size == kOutdatedJump + 2 &&
+                  kOutdatedPattern.value[kOutdatedJump] == 0x74 &&
+                  kOutdatedPattern.mask[kOutdatedJump] == 0xFF,
+              "Outdated writes the jz the pattern ends with");
+
+void Outdated(uint8_t* match) {
+  BYTE patch[] = {0x90, 0x90};
+  WriteMemory(match + kOutdatedJump, patch, sizeof(patch));
+}
+
+// All code patches share a single pass over .text, add new ones here. They
+// only run once MakePatch() hooks LdrLoadDll, and Loader() has that call
+// commented out.
+const CodePatch kCodePatches[] = {
+    {L"Outdated", kOutdatedPattern.view(), Outdated},
+};
+
+void ApplyCodePatches(HMODULE module) {
+  const size_t count = std::size(kCodePatches);
+  std::vector<uint8_t*> matches(count, nullptr);
+
+  // Warm starts take the offsets from the cache and skip the scan.
+  SignatureCache cache(module, L"chrome.dll");
+  MultiPatternScanner scanner;
+  std::vector<size_t> scanned;
+  for (size_t i = 0; i < count; ++i) {
+    matches[i] = cache.Lookup(".text", kCodePatches[i].pattern);
+    if (!matches[i]) {
+      scanner.Add(kCodePatches[i].pattern);
+      scanned.push_back(i);
+    }
+  }
+
+  if (!scanned.empty()) {
+    ScanModuleSection(module, ".text", scanner);
+    for (size_t j = 0; j < scanned.size(); ++j) {
+      size_t i = scanned[j];
+      matches[i] = (uint8_t*)scanner.first_match(j);
+      if (matches[i]) {
+        cache.Store(".text", kCodePatches[i].pattern, matches[i]);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    if (matches[i]) {
+      kCodePatches[i].apply(matches[i]);
+    } else {
+      DebugLog(L"patch %s failed %p", kCodePatches[i].name, module);
+    }
+  }
+}
 
 void DevWarning(HMODULE module) {
   // "enable-automation"
@@ -57,7 +115,7 @@ NTSTATUS WINAPI MyLdrLoadDll(IN PWCHAR PathToFile OPTIONAL,
   if (NT_SUCCESS(ntstatus)) {
     if (wcsstr(ModuleFileName->Buffer, L"chrome.dll") != 0 && !chrome_loaded) {
       chrome_loaded = true;
-      //            Outdated((HMODULE)*ModuleHandle);
+      ApplyCodePatches((HMODULE)*ModuleHandle);
       DevWarning((HMODULE)*ModuleHandle);
     }
   }
@@ -68,7 +126,7 @@ void MakePatch() {
   // HMODULE chrome = GetModuleHandle(L"chrome.dll");
   // if (chrome)
   // {
-  //     Outdated(chrome);
+  //     ApplyCodePatches(chrome);
   //     DevWarning(chrome);
   //     return;
   // }
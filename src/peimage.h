@@ -0,0 +1,368 @@
+#ifndef PEIMAGE_H_
+#define PEIMAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+// A bounds-checked view of a PE image, parsed once.
+//
+// The same headers describe two layouts: a module mapped by the loader, where
+// an RVA is simply an offset from the base, and the file on disk, where each
+// section sits at its PointerToRawData. Every accessor translates for the
+// layout the view was created with and returns nullptr rather than reading
+// outside the buffer. Both PE32 and PE32+ are understood regardless of the
+// bitness of the build, and no Windows headers are needed.
+struct PeSection {
+  char name[9];
+  uint32_t virtual_address;
+  uint32_t virtual_size;
+  uint32_t raw_offset;
+  uint32_t raw_size;
+  uint32_t characteristics;
+};
+
+struct PeExport {
+  const char* name;
+  uint32_t rva;
+
+  // Forwarded exports point to a "module.function" string, not to code.
+  bool forwarded;
+};
+
+struct PeImport {
+  const char* module;
+  uint32_t lookup_rva;
+  uint32_t iat_rva;
+};
+
+class PeImage {
+ public:
+  enum class Layout { kMapped, kFile };
+
+  PeImage(const uint8_t* base, size_t size, Layout layout)
+      : base_(base), size_(size), layout_(layout) {
+    valid_ = Parse();
+  }
+
+  bool valid() const { return valid_; }
+  const uint8_t* base() const { return base_; }
+  size_t size() const { return size_; }
+  Layout layout() const { return layout_; }
+
+  bool is_64bit() const { return is_64bit_; }
+  uint16_t machine() const { return machine_; }
+  uint32_t time_date_stamp() const { return time_date_stamp_; }
+  uint32_t size_of_image() const { return size_of_image_; }
+  uint32_t checksum() const { return checksum_; }
+  uint64_t image_base() const { return image_base_; }
+
+  const std::vector<PeSection>& sections() const { return sections_; }
+  const std::vector<PeExport>& exports() const { return exports_; }
+  const std::vector<PeImport>& imports() const { return imports_; }
+
+  const PeSection* FindSection(const char* name) const {
+    for (const auto& section : sections_) {
+      if (strcmp(section.name, name) == 0)
+        return &section;
+    }
+    return nullptr;
+  }
+
+  // The bytes of a section as they are in this layout.
+  const uint8_t* SectionData(const PeSection& section, size_t* size) const {
+    size_t offset, length;
+    if (layout_ == Layout::kMapped) {
+      // The loader zero-fills up to VirtualSize.
+      offset = section.virtual_address;
+      length = section.virtual_size ? section.virtual_size : section.raw_size;
+    } else {
+      offset = section.raw_offset;
+      length = section.raw_size;
+    }
+    if (offset > size_) {
+      *size = 0;
+      return nullptr;
+    }
+    *size = (length < size_ - offset) ? length : size_ - offset;
+    return base_ + offset;
+  }
+
+  const uint8_t* SectionData(const char* name, size_t* size) const {
+    const PeSection* section = FindSection(name);
+    if (!section) {
+      *size = 0;
+      return nullptr;
+    }
+    return SectionData(*section, size);
+  }
+
+  // Translate [rva, rva + length) into the buffer, nullptr if any of it is
+  // outside.
+  const uint8_t* RvaToPointer(uint64_t rva, size_t length = 1) const {
+    uint64_t offset;
+    if (!RvaToOffset(rva, length, &offset))
+      return nullptr;
+    return base_ + offset;
+  }
+
+  // The inverse of RvaToPointer, (uint32_t)-1 for pointers outside the view.
+  uint32_t PointerToRva(const uint8_t* pointer) const {
+    if (pointer < base_ || pointer >= base_ + size_)
+      return (uint32_t)-1;
+    uint64_t offset = pointer - base_;
+    if (layout_ == Layout::kMapped || offset < size_of_headers_)
+      return (uint32_t)offset;
+    for (const auto& section : sections_) {
+      if (offset >= section.raw_offset &&
+          offset - section.raw_offset < section.raw_size) {
+        return (uint32_t)(section.virtual_address + offset -
+                          section.raw_offset);
+      }
+    }
+    return (uint32_t)-1;
+  }
+
+  // A NUL-terminated string at `rva` that fits in the view.
+  const char* StringAt(uint64_t rva) const {
+    uint64_t offset;
+    if (!RvaToOffset(rva, 1, &offset))
+      return nullptr;
+    // Strings never cross section boundaries in practice, bound the search
+    // by the end of the buffer.
+    if (!memchr(base_ + offset, '\0', size_ - (size_t)offset))
+      return nullptr;
+    return (const char*)(base_ + offset);
+  }
+
+ private:
+  template <typename T>
+  bool Read(uint64_t offset, T* value) const {
+    if (offset > size_ || size_ - offset < sizeof(T))
+      return false;
+    memcpy(value, base_ + offset, sizeof(T));
+    return true;
+  }
+
+  template <typename T>
+  bool ReadRva(uint64_t rva, T* value) const {
+    uint64_t offset;
+    if (!RvaToOffset(rva, sizeof(T), &offset))
+      return false;
+    memcpy(value, base_ + offset, sizeof(T));
+    return true;
+  }
+
+  bool RvaToOffset(uint64_t rva, uint64_t length, uint64_t* offset) const {
+    if (layout_ == Layout::kMapped || rva < size_of_headers_) {
+      *offset = rva;
+    } else {
+      const PeSection* found = nullptr;
+      for (const auto& section : sections_) {
+        if (rva >= section.virtual_address &&
+            rva - section.virtual_address < section.raw_size) {
+          found = &section;
+          break;
+        }
+      }
+      if (!found)
+        return false;
+      // Data past SizeOfRawData only exists in memory.
+      if (rva - found->virtual_address + length > found->raw_size)
+        return false;
+      *offset = found->raw_offset + (rva - found->virtual_address);
+    }
+    return *offset <= size_ && size_ - *offset >= length;
+  }
+
+  bool Parse() {
+    uint16_t dos_magic;
+    uint32_t nt_offset, signature;
+    if (!base_ || !Read(0, &dos_magic) || dos_magic != 0x5A4D ||
+        !Read(0x3C, &nt_offset) || !Read(nt_offset, &signature) ||
+        signature != 0x00004550) {
+      return false;
+    }
+
+    // IMAGE_FILE_HEADER
+    uint64_t file_header = (uint64_t)nt_offset + 4;
+    uint16_t section_count, optional_size;
+    if (!Read(file_header, &machine_) ||
+        !Read(file_header + 2, &section_count) ||
+        !Read(file_header + 4, &time_date_stamp_) ||
+        !Read(file_header + 16, &optional_size)) {
+      return false;
+    }
+
+    // IMAGE_OPTIONAL_HEADER32/64, only the fields at different offsets
+    // depend on the magic.
+    uint64_t optional = file_header + 20;
+    uint16_t magic;
+    if (!Read(optional, &magic))
+      return false;
+    uint64_t directories_offset;
+    uint32_t directory_count;
+    if (magic == 0x20B) {
+      is_64bit_ = true;
+      if (!Read(optional + 24, &image_base_) ||
+          !Read(optional + 108, &directory_count)) {
+        return false;
+      }
+      directories_offset = optional + 112;
+    } else if (magic == 0x10B) {
+      uint32_t image_base;
+      if (!Read(optional + 28, &image_base) ||
+          !Read(optional + 92, &directory_count)) {
+        return false;
+      }
+      image_base_ = image_base;
+      directories_offset = optional + 96;
+    } else {
+      return false;
+    }
+    if (!Read(optional + 56, &size_of_image_) ||
+        !Read(optional + 60, &size_of_headers_) ||
+        !Read(optional + 64, &checksum_)) {
+      return false;
+    }
+
+    // IMAGE_SECTION_HEADER
+    uint64_t section_table = optional + optional_size;
+    for (uint16_t i = 0; i < section_count; ++i) {
+      uint64_t header = section_table + (uint64_t)i * 40;
+      PeSection section = {};
+      if (!Read(header + 8, &section.virtual_size) ||
+          !Read(header + 12, &section.virtual_address) ||
+          !Read(header + 16, &section.raw_size) ||
+          !Read(header + 20, &section.raw_offset) ||
+          !Read(header + 36, &section.characteristics)) {
+        return false;
+      }
+      memcpy(section.name, base_ + header, 8);
+      section.name[8] = '\0';
+      sections_.push_back(section);
+    }
+
+    uint32_t export_rva = 0, export_size = 0, import_rva = 0;
+    if (directory_count > 0) {
+      Read(directories_offset, &export_rva);
+      Read(directories_offset + 4, &export_size);
+    }
+    if (directory_count > 1) {
+      Read(directories_offset + 8, &import_rva);
+    }
+    ParseExports(export_rva, export_size);
+    ParseImports(import_rva);
+    return true;
+  }
+
+  // IMAGE_EXPORT_DIRECTORY
+  void ParseExports(uint32_t rva, uint32_t size) {
+    uint32_t function_count, name_count, functions, names, ordinals;
+    if (!rva || !ReadRva(rva + 20, &function_count) ||
+        !ReadRva(rva + 24, &name_count) || !ReadRva(rva + 28, &functions) ||
+        !ReadRva(rva + 32, &names) || !ReadRva(rva + 36, &ordinals)) {
+      return;
+    }
+
+    for (uint32_t i = 0; i < name_count; ++i) {
+      uint32_t name_rva, function_rva;
+      uint16_t ordinal;
+      if (!ReadRva(names + (uint64_t)i * 4, &name_rva) ||
+          !ReadRva(ordinals + (uint64_t)i * 2, &ordinal) ||
+          ordinal >= function_count ||
+          !ReadRva(functions + (uint64_t)ordinal * 4, &function_rva)) {
+        continue;
+      }
+      const char* name = StringAt(name_rva);
+      if (!name)
+        continue;
+      bool forwarded = function_rva >= rva && function_rva - rva < size;
+      exports_.push_back({name, function_rva, forwarded});
+    }
+  }
+
+  // IMAGE_IMPORT_DESCRIPTOR, terminated by an all-zero entry.
+  void ParseImports(uint32_t rva) {
+    if (!rva)
+      return;
+    for (uint64_t descriptor = rva;; descriptor += 20) {
+      uint32_t lookup, name, iat;
+      if (!ReadRva(descriptor, &lookup) || !ReadRva(descriptor + 12, &name) ||
+          !ReadRva(descriptor + 16, &iat) || (!name && !iat)) {
+        break;
+      }
+      const char* module = StringAt(name);
+      if (module) {
+        imports_.push_back({module, lookup ? lookup : iat, iat});
+      }
+    }
+  }
+
+  const uint8_t* base_;
+  size_t size_;
+  Layout layout_;
+  bool valid_ = false;
+
+  bool is_64bit_ = false;
+  uint16_t machine_ = 0;
+  uint32_t time_date_stamp_ = 0;
+  uint32_t size_of_image_ = 0;
+  uint32_t size_of_headers_ = 0;
+  uint32_t checksum_ = 0;
+  uint64_t image_base_ = 0;
+
+  std::vector<PeSection> sections_;
+  std::vector<PeExport> exports_;
+  std::vector<PeImport> imports_;
+};
+
+#ifdef _WIN32
+#include <windows.h>
+
+#include <memory>
+#include <unordered_map>
+
+// The parsed image of a loaded module, shared by everything that needs its
+// headers. Entries are re-validated against the live header so that a module
+// unloaded and replaced at the same address is parsed again. Callers keep
+// the returned reference, such as SignatureCache, so an image that is
+// replaced is retired rather than freed and its references stay valid.
+const PeImage& GetModuleImage(HMODULE module) {
+  static SRWLOCK lock = SRWLOCK_INIT;
+  static std::unordered_map<HMODULE, std::unique_ptr<PeImage>> images;
+  static std::vector<std::unique_ptr<PeImage>> retired;
+
+  // The loader maps the headers as they are in the file, on pages of their
+  // own. They are parsed within those pages first, and only the SizeOfImage
+  // of valid headers sizes the view of the whole module; anything else gets
+  // an empty, invalid image.
+  const uint8_t* base = (const uint8_t*)module;
+  MEMORY_BASIC_INFORMATION memory;
+  size_t header_size = 0;
+  if (VirtualQuery(base, &memory, sizeof(memory)) &&
+      memory.State == MEM_COMMIT &&
+      !(memory.Protect & (PAGE_NOACCESS | PAGE_GUARD))) {
+    header_size = memory.RegionSize;
+  }
+  PeImage header(base, header_size, PeImage::Layout::kMapped);
+  size_t size = header.valid() ? header.size_of_image() : 0;
+  uint32_t time_date_stamp = header.time_date_stamp();
+
+  AcquireSRWLockExclusive(&lock);
+  auto& image = images[module];
+  if (!image || image->size() != size ||
+      image->time_date_stamp() != time_date_stamp) {
+    if (image)
+      retired.push_back(std::move(image));
+    image = std::make_unique<PeImage>(base, size, PeImage::Layout::kMapped);
+  }
+  const PeImage& result = *image;
+  ReleaseSRWLockExclusive(&lock);
+  return result;
+}
+#endif  // _WIN32
+
+#endif  // PEIMAGE_H_
@@ -10,9 +10,9 @@ std::wstring GetCommand(LPWSTR param) {
 
   int insert_pos = 0;
   for (int i = 0; i < argc; ++i) {
-    if (std::wstring(argv[i]).find(L"--") != std::wstring::npos ||
-        std::wstring(argv[i]).find(L"--single-argument") !=
-            std::wstring::npos) {
+    std::wstring_view arg = argv[i];
+    if (arg.find(L"--") != std::wstring_view::npos ||
+        arg.find(L"--single-argument") != std::wstring_view::npos) {
       break;
     }
     insert_pos = i;
@@ -39,26 +39,23 @@ std::wstring GetCommand(LPWSTR param) {
       }
 
       // Get the command line and append parameters
-      // Intercept and split the parameters starting with each --,
-      // and then args.push_back multiple times
-      // Repeat the above process until the -- sign no longer exists in the
-      // string
+      // Split the parameters before each " --" and push each of them. Text
+      // before the first -- goes with the last parameter.
       {
         auto cr_command_line = GetCrCommandLine();
-        std::wstring temp = cr_command_line;
-        while (true) {
-          auto pos = temp.find(L"--");
-          if (pos == std::wstring::npos) {
-            break;
-          } else {
-            auto pos2 = temp.find(L" --", pos);
-            if (pos2 == std::wstring::npos) {
-              args.push_back(temp);
+        std::wstring_view line = cr_command_line;
+        size_t start = line.find(L"--");
+        if (start != std::wstring_view::npos) {
+          std::wstring_view prefix = line.substr(0, start);
+          for (;;) {
+            size_t end = line.find(L" --", start);
+            if (end == std::wstring_view::npos) {
+              args.emplace_back(prefix);
+              args.back().append(line.substr(start));
               break;
-            } else {
-              args.push_back(temp.substr(pos, pos2 - pos));
-              temp = temp.substr(0, pos) + temp.substr(pos2 + 1);
             }
+            args.emplace_back(line.substr(start, end - start));
+            start = end + 1;
           }
         }
       }
@@ -84,16 +81,12 @@ bool IsFirstRun() {
 void LaunchCommands(const std::wstring& get_commands,
                     int show_command,
                     std::vector<HANDLE>* program_handles) {
-  auto commands = StringSplit(
-      get_commands, L';',
-      L"");  // Quotes should not be used as they can cause errors with paths
-             // that contain spaces. Since semicolons rarely appear in names and
-             // commands, they are used as delimiters.
-  if (commands.empty()) {
-    return;
-  }
-  for (const auto& command : commands) {
-    std::wstring expanded_path = ExpandEnvironmentPath(command);
+  // Quotes should not be used as they can cause errors with paths that
+  // contain spaces. Since semicolons rarely appear in names and commands,
+  // they are used as delimiters.
+  for (std::wstring_view command : Tokenizer<wchar_t>(get_commands, L';')) {
+    // Expansion needs a terminated string.
+    std::wstring expanded_path = ExpandEnvironmentPath(std::wstring(command));
     ReplaceStringInPlace(expanded_path, L"%app%", GetAppDir());
     HANDLE handle = RunExecute(expanded_path.c_str(), show_command);
     if (program_handles != nullptr && handle != nullptr) {
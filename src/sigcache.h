@@ -0,0 +1,90 @@
+#ifndef SIGCACHE_H_
+#define SIGCACHE_H_
+
+#include <iterator>
+
+// Resolved signature offsets survive restarts until the module changes.
+const std::wstring kCachePath = GetAppDir() + L"\\chrome++_cache.ini";
+
+// FNV-1a, used to key cache entries.
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 0) {
+  if (!hash)
+    hash = 0xcbf29ce484222325ull;
+  const uint8_t* bytes = (const uint8_t*)data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+uint64_t HashPattern(const char* section, const PatternView& pattern) {
+  uint64_t hash = HashBytes(section, strlen(section));
+  hash = HashBytes(pattern.value, pattern.size, hash);
+  if (pattern.mask) {
+    hash = HashBytes(pattern.mask, pattern.size, hash);
+  }
+  return hash;
+}
+
+// Signature offsets of one module, stored in a section of the cache file
+// named after the module. The section is keyed by the PE TimeDateStamp,
+// SizeOfImage and CheckSum, so a Chrome update invalidates all of it.
+class SignatureCache {
+ public:
+  SignatureCache(HMODULE module, const wchar_t* name)
+      : image_(GetModuleImage(module)), section_(name) {
+    identity_ = Format(L"%08X-%08X-%08X", image_.time_date_stamp(),
+                       image_.size_of_image(), image_.checksum());
+
+    auto cached = GetCacheString(L"identity");
+    if (cached != identity_) {
+      // Drop the offsets of the previous build.
+      ::WritePrivateProfileStringW(section_.c_str(), nullptr, nullptr,
+                                   kCachePath.c_str());
+      ::WritePrivateProfileStringW(section_.c_str(), L"identity",
+                                   identity_.c_str(), kCachePath.c_str());
+    }
+  }
+
+  // The cached match of `pattern`, if the bytes there still match.
+  uint8_t* Lookup(const char* section, const PatternView& pattern) {
+    auto value = GetCacheString(Key(section, pattern).c_str());
+    if (value.empty())
+      return nullptr;
+
+    uint64_t rva = wcstoull(value.c_str(), nullptr, 16);
+    const uint8_t* match = image_.RvaToPointer(rva, pattern.size);
+    if (!match || !MatchPattern(match, pattern))
+      return nullptr;
+    return (uint8_t*)match;
+  }
+
+  void Store(const char* section,
+             const PatternView& pattern,
+             const uint8_t* match) {
+    auto value = Format(L"%X", image_.PointerToRva(match));
+    ::WritePrivateProfileStringW(section_.c_str(),
+                                 Key(section, pattern).c_str(), value.c_str(),
+                                 kCachePath.c_str());
+  }
+
+ private:
+  std::wstring Key(const char* section, const PatternView& pattern) {
+    return Format(L"%016llX",
+                  (unsigned long long)HashPattern(section, pattern));
+  }
+
+  std::wstring GetCacheString(const wchar_t* key) {
+    wchar_t buffer[64];
+    ::GetPrivateProfileStringW(section_.c_str(), key, L"", buffer,
+                               (DWORD)std::size(buffer), kCachePath.c_str());
+    return buffer;
+  }
+
+  const PeImage& image_;
+  std::wstring section_;
+  std::wstring identity_;
+};
+
+#endif  // SIGCACHE_H_
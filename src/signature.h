@@ -0,0 +1,190 @@
+#ifndef SIGNATURE_H_
+#define SIGNATURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fastsearch.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIGNATURE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// A byte signature with wildcards, written in the IDA style:
+//   "48 89 ?? 24 F0 00 00 00 80 3D"
+// "?" or "??" matches any byte, a single "?" nibble such as "4?" matches
+// that nibble only. `value` is stored pre-masked.
+struct PatternView {
+  const uint8_t* value;
+  const uint8_t* mask;
+  size_t size;
+
+  // The longest run of fully fixed bytes, searched with FastSearch before the
+  // masked bytes around it are verified.
+  size_t anchor;
+  size_t anchor_size;
+};
+
+template <size_t N>
+struct BytePattern {
+  uint8_t value[N];
+  uint8_t mask[N];
+  size_t size;
+  size_t anchor;
+  size_t anchor_size;
+
+  constexpr PatternView view() const {
+    return {value, mask, size, anchor, anchor_size};
+  }
+};
+
+// Exact byte strings are patterns without a mask, anchored on every byte.
+inline PatternView ExactPattern(const uint8_t* bytes, size_t size) {
+  return {bytes, nullptr, size, 0, size};
+}
+
+constexpr bool IsPatternSpace(char c) {
+  return c == ' ' || c == '\t';
+}
+
+constexpr int PatternNibble(char c) {
+  return c >= '0' && c <= '9'   ? c - '0'
+         : c >= 'A' && c <= 'F' ? c - 'A' + 10
+         : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                                : -1;
+}
+
+// Every byte takes at least one character and a separator, so a literal of
+// L characters (including the terminator) holds at most L / 2 bytes.
+// Malformed input throws, which is a compile error when the result is
+// declared constexpr.
+template <size_t L>
+constexpr BytePattern<(L / 2 > 0 ? L / 2 : 1)> ParsePattern(
+    const char (&text)[L]) {
+  BytePattern<(L / 2 > 0 ? L / 2 : 1)> pattern{};
+
+  size_t i = 0;
+  while (i < L - 1) {
+    if (IsPatternSpace(text[i])) {
+      ++i;
+      continue;
+    }
+
+    if (pattern.size >= sizeof(pattern.value))
+      throw "signature too long";
+
+    uint8_t value = 0;
+    uint8_t mask = 0;
+    if (text[i] == '?' && (i + 1 >= L - 1 || IsPatternSpace(text[i + 1]))) {
+      // A single "?" is a full wildcard byte.
+      ++i;
+    } else {
+      for (int half = 0; half < 2; ++half, ++i) {
+        if (i >= L - 1)
+          throw "truncated signature byte";
+        value <<= 4;
+        mask <<= 4;
+        if (text[i] != '?') {
+          int nibble = PatternNibble(text[i]);
+          if (nibble < 0)
+            throw "invalid signature character";
+          value |= (uint8_t)nibble;
+          mask |= 0xF;
+        }
+      }
+      if (i < L - 1 && !IsPatternSpace(text[i]))
+        throw "signature bytes must be separated by spaces";
+    }
+
+    pattern.value[pattern.size] = value;
+    pattern.mask[pattern.size] = mask;
+    ++pattern.size;
+  }
+
+  // Anchor on the longest run of fixed bytes.
+  size_t run = 0;
+  for (size_t j = 0; j < pattern.size; ++j) {
+    run = pattern.mask[j] == 0xFF ? run + 1 : 0;
+    if (run > pattern.anchor_size) {
+      pattern.anchor_size = run;
+      pattern.anchor = j + 1 - run;
+    }
+  }
+
+  return pattern;
+}
+
+// Check the masked bytes of `pattern` against `s`, 16 bytes at a time.
+static bool MatchPattern(const uint8_t* s, const PatternView& pattern) {
+  if (!pattern.mask)
+    return memcmp(s, pattern.value, pattern.size) == 0;
+
+  size_t i = 0;
+#ifdef SIGNATURE_SSE2
+  for (; i + 16 <= pattern.size; i += 16) {
+    const __m128i data = _mm_loadu_si128((const __m128i*)(s + i));
+    const __m128i mask = _mm_loadu_si128((const __m128i*)(pattern.mask + i));
+    const __m128i value =
+        _mm_loadu_si128((const __m128i*)(pattern.value + i));
+    const __m128i eq = _mm_cmpeq_epi8(_mm_and_si128(data, mask), value);
+    if (_mm_movemask_epi8(eq) != 0xFFFF)
+      return false;
+  }
+#endif
+  for (; i < pattern.size; ++i) {
+    if ((s[i] & pattern.mask[i]) != pattern.value[i])
+      return false;
+  }
+  return true;
+}
+
+// Find the first position in [s, s + n) where `pattern` matches.
+static const uint8_t* PatternSearch(const uint8_t* s,
+                                    size_t n,
+                                    const PatternView& pattern) {
+  if (!s || n < pattern.size)
+    return nullptr;
+
+  if (!pattern.mask)
+    return SearchBytes(s, n, pattern.value, pattern.size);
+
+  const uint8_t* end = s + n;
+  if (pattern.anchor_size == 0) {
+    // Nothing fixed to anchor on, verify every position.
+    for (const uint8_t* pos = s; pos + pattern.size <= end; ++pos) {
+      if (MatchPattern(pos, pattern))
+        return pos;
+    }
+    return nullptr;
+  }
+
+  // The anchor can only start where the whole pattern fits around it.
+  const uint8_t* anchor_begin = s + pattern.anchor;
+  const uint8_t* anchor_end = end - (pattern.size - pattern.anchor);
+  const uint8_t* anchor = pattern.value + pattern.anchor;
+  while (anchor_begin <= anchor_end) {
+    size_t length = anchor_end - anchor_begin + pattern.anchor_size;
+    const uint8_t* hit =
+        SearchBytes(anchor_begin, length, anchor, pattern.anchor_size);
+    if (!hit)
+      break;
+
+    const uint8_t* start = hit - pattern.anchor;
+    if (MatchPattern(start, pattern))
+      return start;
+    anchor_begin = hit + 1;
+  }
+  return nullptr;
+}
+
+template <size_t N>
+const uint8_t* PatternSearch(const uint8_t* s,
+                             size_t n,
+                             const BytePattern<N>& pattern) {
+  return PatternSearch(s, n, pattern.view());
+}
+
+#endif  // SIGNATURE_H_
@@ -0,0 +1,429 @@
+#ifndef TEXTUTILS_H_
+#define TEXTUTILS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cctype>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "fastsearch.h"
+
+// String helpers without Windows dependencies, shared with the tools.
+
+// Splits `text` at `delim` lazily, yielding views into it, so nothing is
+// copied until a caller keeps a token. With an enclosure, a token loses one
+// leading enclosure.front() and one trailing enclosure.back(). The token after
+// the last delimiter is skipped when it is empty, unless `keep_last_empty`.
+//
+//   for (std::wstring_view name : Tokenizer<wchar_t>(names, L',', L"\""))
+//
+// The text must outlive the tokenizer and its tokens.
+template <typename Char>
+class Tokenizer {
+ public:
+  using View = std::basic_string_view<Char>;
+
+  Tokenizer(View text,
+            Char delim,
+            View enclosure = View(),
+            bool keep_last_empty = false)
+      : text_(text),
+        delim_(delim),
+        enclosure_(enclosure),
+        keep_last_empty_(keep_last_empty) {}
+
+  // The next token in `token`, false once there are no more.
+  bool Next(View* token) {
+    if (done_)
+      return false;
+    size_t end = text_.find(delim_, start_);
+    if (end == View::npos) {
+      done_ = true;
+      if (start_ == text_.size() && !keep_last_empty_)
+        return false;
+      end = text_.size();
+    }
+    View next = text_.substr(start_, end - start_);
+    start_ = end + 1;
+    if (!enclosure_.empty() && !next.empty() &&
+        next.front() == enclosure_.front()) {
+      next.remove_prefix(1);
+    }
+    if (!enclosure_.empty() && !next.empty() &&
+        next.back() == enclosure_.back()) {
+      next.remove_suffix(1);
+    }
+    *token = next;
+    return true;
+  }
+
+  class iterator {
+   public:
+    explicit iterator(Tokenizer* tokenizer) : tokenizer_(tokenizer) {
+      ++*this;
+    }
+
+    View operator*() const { return token_; }
+    iterator& operator++() {
+      if (tokenizer_ && !tokenizer_->Next(&token_))
+        tokenizer_ = nullptr;
+      return *this;
+    }
+    bool operator!=(const iterator& other) const {
+      return tokenizer_ != other.tokenizer_;
+    }
+
+   private:
+    Tokenizer* tokenizer_;
+    View token_;
+  };
+
+  iterator begin() { return iterator(this); }
+  iterator end() { return iterator(nullptr); }
+
+ private:
+  View text_;
+  Char delim_;
+  View enclosure_;
+  bool keep_last_empty_;
+  size_t start_ = 0;
+  bool done_ = false;
+};
+
+// Specify the delimiter and wrapper to split the string.
+std::vector<std::wstring> StringSplit(const std::wstring& str,
+                                      const wchar_t delim,
+                                      const std::wstring& enclosure) {
+  std::vector<std::wstring> result;
+  for (std::wstring_view name : Tokenizer<wchar_t>(str, delim, enclosure)) {
+    result.emplace_back(name);
+  }
+  return result;
+}
+
+// Compression html.
+std::string& ltrim(std::string& s) {
+  s.erase(s.begin(), std::find_if(s.begin(), s.end(),
+                                  [](int ch) { return !std::isspace(ch); }));
+  return s;
+}
+std::string& rtrim(std::string& s) {
+  s.erase(std::find_if(s.rbegin(), s.rend(),
+                       [](int ch) { return !std::isspace(ch); })
+              .base(),
+          s.end());
+  return s;
+}
+
+std::string& trim(std::string& s) {
+  return ltrim(rtrim(s));
+}
+
+std::vector<std::string> split(const std::string& text, char sep) {
+  std::vector<std::string> tokens;
+  for (std::string_view token : Tokenizer<char>(text, sep, {}, true)) {
+    tokens.emplace_back(token);
+  }
+  return tokens;
+}
+
+// The lowest and the highest set bit of a non-zero mask.
+inline unsigned LowestBit(uint32_t mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return index;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+inline unsigned HighestBit(uint32_t mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanReverse(&index, mask);
+  return index;
+#else
+  return 31 - __builtin_clz(mask);
+#endif
+}
+
+// What trim() strips: std::isspace in the C locale.
+inline bool IsAsciiSpace(uint8_t c) {
+  return c == ' ' || (uint8_t)(c - '\t') <= '\r' - '\t';
+}
+
+// The state of CompressHtml() between blocks of input. Each block comes with
+// a mask of its newlines and one of its other non-blank bytes. The text of a
+// line is copied as it is seen and the output rewound to the end of its last
+// non-blank byte when the line ends, so every byte is classified and copied
+// once.
+class HtmlCompressor {
+ public:
+  HtmlCompressor(const uint8_t* in, uint8_t* out) : in_(in), out_(out) {
+    out_[out_pos_++] = '\n';
+    text_end_ = out_pos_;
+  }
+
+  // The `width` bytes at `pos`, up to 32.
+  void Block(size_t pos, size_t width, uint32_t newlines, uint32_t text) {
+    uint32_t all = width == 32 ? ~0u : (1u << width) - 1;
+    uint32_t from = all;
+    for (;;) {
+      if (copy_from_ == kNotCopying) {
+        // Leading blanks are skipped.
+        uint32_t next = (text | newlines) & from;
+        if (!next)
+          return;
+        unsigned bit = LowestBit(next);
+        if (!(text >> bit & 1)) {
+          NewLine();
+          from = all & ~((2u << bit) - 1);
+          continue;
+        }
+        copy_from_ = pos + bit;
+        copy_to_ = out_pos_;
+        from = all & ~((1u << bit) - 1);
+      }
+
+      unsigned begin = LowestBit(from);
+      uint32_t line_end = newlines & from;
+      unsigned end = line_end ? LowestBit(line_end) : (unsigned)width;
+      memcpy(out_ + copy_to_ + (pos + begin - copy_from_), in_ + pos + begin,
+             end - begin);
+      uint32_t kept = text & from & (end == 32 ? ~0u : (1u << end) - 1);
+      if (kept)
+        text_end_ = copy_to_ + (pos + HighestBit(kept) + 1 - copy_from_);
+      if (!line_end)
+        return;
+      NewLine();
+      from = all & ~((2u << end) - 1);
+    }
+  }
+
+  // The size of the output.
+  size_t Finish() { return text_end_; }
+
+ private:
+  static constexpr size_t kNotCopying = ~(size_t)0;
+
+  void NewLine() {
+    out_pos_ = text_end_;
+    out_[out_pos_++] = '\n';
+    text_end_ = out_pos_;
+    copy_from_ = kNotCopying;
+  }
+
+  const uint8_t* in_;
+  uint8_t* out_;
+  size_t out_pos_ = 0;
+  size_t text_end_ = 0;
+  size_t copy_from_ = kNotCopying;
+  size_t copy_to_ = 0;
+};
+
+// Bytes [pos, pos + width) of `in` as HtmlCompressor masks.
+inline void ClassifyHtmlBytes(const uint8_t* in,
+                              size_t pos,
+                              size_t width,
+                              uint32_t* newlines,
+                              uint32_t* text) {
+  *newlines = 0;
+  *text = 0;
+  for (size_t i = 0; i < width; ++i) {
+    uint8_t c = in[pos + i];
+    *newlines |= (uint32_t)(c == '\n') << i;
+    *text |= (uint32_t)!IsAsciiSpace(c) << i;
+  }
+}
+
+inline size_t ScalarCompressHtml(const uint8_t* in,
+                                 size_t size,
+                                 uint8_t* out) {
+  HtmlCompressor compressor(in, out);
+  for (size_t pos = 0; pos < size; pos += 32) {
+    size_t width = (std::min)(size - pos, (size_t)32);
+    uint32_t newlines;
+    uint32_t text;
+    ClassifyHtmlBytes(in, pos, width, &newlines, &text);
+    compressor.Block(pos, width, newlines, text);
+  }
+  return compressor.Finish();
+}
+
+#ifdef FASTSEARCH_X86
+// Blanks are ' ' and '\t' to '\r', the latter found with one unsigned
+// compare after subtracting '\t'.
+FASTSEARCH_TARGET_SSE2
+static size_t Sse2CompressHtml(const uint8_t* in, size_t size, uint8_t* out) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i controls = _mm_set1_epi8('\r' - '\t');
+  HtmlCompressor compressor(in, out);
+  size_t pos = 0;
+  for (; pos + 16 <= size; pos += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i*)(in + pos));
+    __m128i shifted = _mm_sub_epi8(block, tab);
+    __m128i blank = _mm_or_si128(
+        _mm_cmpeq_epi8(block, space),
+        _mm_cmpeq_epi8(_mm_min_epu8(shifted, controls), shifted));
+    compressor.Block(
+        pos, 16,
+        (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)),
+        ~(uint32_t)_mm_movemask_epi8(blank) & 0xFFFF);
+  }
+  if (pos < size) {
+    uint32_t newlines;
+    uint32_t text;
+    ClassifyHtmlBytes(in, pos, size - pos, &newlines, &text);
+    compressor.Block(pos, size - pos, newlines, text);
+  }
+  return compressor.Finish();
+}
+
+FASTSEARCH_TARGET_AVX2
+static size_t Avx2CompressHtml(const uint8_t* in, size_t size, uint8_t* out) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i controls = _mm256_set1_epi8('\r' - '\t');
+  HtmlCompressor compressor(in, out);
+  size_t pos = 0;
+  for (; pos + 32 <= size; pos += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i*)(in + pos));
+    __m256i shifted = _mm256_sub_epi8(block, tab);
+    __m256i blank = _mm256_or_si256(
+        _mm256_cmpeq_epi8(block, space),
+        _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, controls), shifted));
+    compressor.Block(
+        pos, 32,
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)),
+        ~(uint32_t)_mm256_movemask_epi8(blank));
+  }
+  if (pos < size) {
+    uint32_t newlines;
+    uint32_t text;
+    ClassifyHtmlBytes(in, pos, size - pos, &newlines, &text);
+    compressor.Block(pos, size - pos, newlines, text);
+  }
+  return compressor.Finish();
+}
+#endif  // FASTSEARCH_X86
+
+typedef size_t (*CompressHtmlKernel)(const uint8_t* in,
+                                     size_t size,
+                                     uint8_t* out);
+
+static CompressHtmlKernel GetCompressHtmlKernel() {
+  static const CompressHtmlKernel kernel = []() -> CompressHtmlKernel {
+#ifdef FASTSEARCH_X86
+    if (CpuSupportsAvx2())
+      return Avx2CompressHtml;
+    if (CpuSupportsSse2())
+      return Sse2CompressHtml;
+#endif
+    return ScalarCompressHtml;
+  }();
+  return kernel;
+}
+
+// compression_html() of the `size` bytes at `in` into `out`, which must have
+// room for size + 1 bytes and must not overlap `in`. Returns the size of the
+// output, which is at most size + 1.
+inline size_t CompressHtml(const uint8_t* in, size_t size, uint8_t* out) {
+  return GetCompressHtmlKernel()(in, size, out);
+}
+
+// Every line trimmed and preceded by a newline.
+void compression_html(std::string& html) {
+  std::string compressed(html.size() + 1, '\0');
+  compressed.resize(CompressHtml((const uint8_t*)html.data(), html.size(),
+                                 (uint8_t*)&compressed[0]));
+  html.swap(compressed);
+}
+
+inline size_t FindString(const char* s, size_t n, const char* p, size_t m) {
+  const uint8_t* found =
+      SearchBytes((const uint8_t*)s, n, (const uint8_t*)p, m);
+  return found ? (size_t)(found - (const uint8_t*)s) : n;
+}
+
+inline size_t FindString(const wchar_t* s,
+                         size_t n,
+                         const wchar_t* p,
+                         size_t m) {
+  const wchar_t* found = std::search(s, s + n, p, p + m);
+  return (size_t)(found - s);
+}
+
+// Replace every occurrence of `search` from left to right, not looking into
+// the replacements. The matches are found on the original and the result is
+// written in one pass: in place when the replacement is not longer, else
+// into one buffer that replaces the subject. An empty search replaces
+// nothing.
+template <typename Char>
+bool ReplaceAll(std::basic_string<Char>& subject,
+                const std::basic_string<Char>& search,
+                const std::basic_string<Char>& replace) {
+  const size_t size = subject.size();
+  const size_t m = search.size();
+  if (!m || size < m)
+    return false;
+  size_t pos = FindString(subject.data(), size, search.data(), m);
+  if (pos == size)
+    return false;
+
+  if (replace.size() <= m) {
+    Char* data = &subject[0];
+    size_t out = pos;
+    while (pos < size) {
+      memcpy(data + out, replace.data(), replace.size() * sizeof(Char));
+      out += replace.size();
+      pos += m;
+      size_t next = pos + FindString(data + pos, size - pos, search.data(), m);
+      memmove(data + out, data + pos, (next - pos) * sizeof(Char));
+      out += next - pos;
+      pos = next;
+    }
+    subject.resize(out);
+    return true;
+  }
+
+  std::basic_string<Char> result;
+  result.reserve(size + (replace.size() - m) * 4);
+  result.append(subject, 0, pos);
+  while (pos < size) {
+    result.append(replace);
+    pos += m;
+    size_t next =
+        pos + FindString(subject.data() + pos, size - pos, search.data(), m);
+    result.append(subject, pos, next - pos);
+    pos = next;
+  }
+  subject.swap(result);
+  return true;
+}
+
+bool ReplaceStringInPlace(std::string& subject,
+                          const std::string& search,
+                          const std::string& replace) {
+  return ReplaceAll(subject, search, replace);
+}
+
+bool ReplaceStringInPlace(std::wstring& subject,
+                          const std::wstring& search,
+                          const std::wstring& replace) {
+  return ReplaceAll(subject, search, replace);
+}
+
+#endif  // TEXTUTILS_H_
@@ -13,6 +13,11 @@
 #pragma comment(lib, "Shlwapi.lib")
 
 #include "FastSearch.h"
+#include "multisearch.h"
+#include "parallel.h"
+#include "peimage.h"
+#include "signature.h"
+#include "textutils.h"
 
 // https://source.chromium.org/chromium/chromium/src/+/main:chrome/app/chrome_command_ids.h?q=chrome_command_ids.h&ss=chromium%2Fchromium%2Fsrc
 #define IDC_NEW_TAB 34014
@@ -68,108 +73,6 @@ std::string wstring_to_string(const std::wstring& wstr) {
   return strTo;
 }
 
-// Specify the delimiter and wrapper to split the string.
-std::vector<std::wstring> StringSplit(const std::wstring& str,
-                                      const wchar_t delim,
-                                      const std::wstring& enclosure) {
-  std::vector<std::wstring> result;
-  std::wstring::size_type start = 0;
-  std::wstring::size_type end = str.find(delim);
-  while (end != std::wstring::npos) {
-    std::wstring name = str.substr(start, end - start);
-    if (!enclosure.empty() && !name.empty() &&
-        name.front() == enclosure.front()) {
-      name.erase(0, 1);
-    }
-    if (!enclosure.empty() && !name.empty() &&
-        name.back() == enclosure.back()) {
-      name.erase(name.size() - 1);
-    }
-    result.push_back(name);
-    start = end + 1;
-    end = str.find(delim, start);
-  }
-  if (start < str.length()) {
-    std::wstring name = str.substr(start);
-    if (!enclosure.empty() && !name.empty() &&
-        name.front() == enclosure.front()) {
-      name.erase(0, 1);
-    }
-    if (!enclosure.empty() && !name.empty() &&
-        name.back() == enclosure.back()) {
-      name.erase(name.size() - 1);
-    }
-    result.push_back(name);
-  }
-  return result;
-}
-
-// Compression html.
-std::string& ltrim(std::string& s) {
-  s.erase(s.begin(), std::find_if(s.begin(), s.end(),
-                                  [](int ch) { return !std::isspace(ch); }));
-  return s;
-}
-std::string& rtrim(std::string& s) {
-  s.erase(std::find_if(s.rbegin(), s.rend(),
-                       [](int ch) { return !std::isspace(ch); })
-              .base(),
-          s.end());
-  return s;
-}
-
-std::string& trim(std::string& s) {
-  return ltrim(rtrim(s));
-}
-
-std::vector<std::string> split(const std::string& text, char sep) {
-  std::vector<std::string> tokens;
-  std::size_t start = 0, end = 0;
-  while ((end = text.find(sep, start)) != std::string::npos) {
-    std::string temp = text.substr(start, end - start);
-    tokens.push_back(temp);
-    start = end + 1;
-  }
-  std::string temp = text.substr(start);
-  tokens.push_back(temp);
-  return tokens;
-}
-
-void compression_html(std::string& html) {
-  auto lines = split(html, '\n');
-  html.clear();
-  for (auto& line : lines) {
-    html += "\n";
-    html += trim(line);
-  }
-}
-
-bool ReplaceStringInPlace(std::string& subject,
-                          const std::string& search,
-                          const std::string& replace) {
-  bool find = false;
-  size_t pos = 0;
-  while ((pos = subject.find(search, pos)) != std::string::npos) {
-    subject.replace(pos, search.length(), replace);
-    pos += replace.length();
-    find = true;
-  }
-  return find;
-}
-
-bool ReplaceStringInPlace(std::wstring& subject,
-                          const std::wstring& search,
-                          const std::wstring& replace) {
-  bool find = false;
-  size_t pos = 0;
-  while ((pos = subject.find(search, pos)) != std::wstring::npos) {
-    subject.replace(pos, search.length(), replace);
-    pos += replace.length();
-    find = true;
-  }
-  return find;
-}
-
 std::wstring QuoteSpaceIfNeeded(const std::wstring& str) {
   if (str.find(L' ') == std::wstring::npos)
     return std::move(str);
@@ -200,63 +103,71 @@ std::wstring JoinArgsString(std::vector<std::wstring> lines,
 
 // Memory and module search functions.
 // Search memory.
-uint8_t* memmem(uint8_t* src, int n, const uint8_t* sub, int m) {
-  return (uint8_t*)FastSearch(src, n, sub, m);
+uint8_t* memmem(uint8_t* src, size_t n, const uint8_t* sub, size_t m) {
+  return (uint8_t*)SearchBytes(src, n, sub, m);
 }
 
-uint8_t* SearchModuleRaw(HMODULE module, const uint8_t* sub, int m) {
-  uint8_t* buffer = (uint8_t*)module;
+// The bytes of a section of a loaded module, located through its parsed
+// headers.
+const uint8_t* GetModuleSection(HMODULE module,
+                                const char* name,
+                                size_t* size) {
+  return GetModuleImage(module).SectionData(name, size);
+}
 
-  PIMAGE_NT_HEADERS nt_header =
-      (PIMAGE_NT_HEADERS)(buffer + ((PIMAGE_DOS_HEADER)buffer)->e_lfanew);
-  PIMAGE_SECTION_HEADER section =
-      (PIMAGE_SECTION_HEADER)((char*)nt_header + sizeof(DWORD) +
-                              sizeof(IMAGE_FILE_HEADER) +
-                              nt_header->FileHeader.SizeOfOptionalHeader);
+// The module searches split large sections into chunks that are scanned on a
+// few threads, with the same result as a serial scan.
+uint8_t* SearchModuleSection(HMODULE module,
+                             const char* name,
+                             const uint8_t* sub,
+                             size_t m) {
+  size_t size;
+  const uint8_t* section = GetModuleSection(module, name, &size);
+  return (uint8_t*)ParallelSearch(section, size, sub, m);
+}
 
-  for (int i = 0; i < nt_header->FileHeader.NumberOfSections; ++i) {
-    if (strcmp((const char*)section[i].Name, ".text") == 0) {
-      return memmem(buffer + section[i].PointerToRawData,
-                    section[i].SizeOfRawData, sub, m);
-      break;
-    }
-  }
-  return nullptr;
+uint8_t* SearchModuleRaw(HMODULE module, const uint8_t* sub, size_t m) {
+  return SearchModuleSection(module, ".text", sub, m);
 }
 
-uint8_t* SearchModuleRaw2(HMODULE module, const uint8_t* sub, int m) {
-  uint8_t* buffer = (uint8_t*)module;
+uint8_t* SearchModuleRaw2(HMODULE module, const uint8_t* sub, size_t m) {
+  return SearchModuleSection(module, ".rdata", sub, m);
+}
 
-  PIMAGE_NT_HEADERS nt_header =
-      (PIMAGE_NT_HEADERS)(buffer + ((PIMAGE_DOS_HEADER)buffer)->e_lfanew);
-  PIMAGE_SECTION_HEADER section =
-      (PIMAGE_SECTION_HEADER)((char*)nt_header + sizeof(DWORD) +
-                              sizeof(IMAGE_FILE_HEADER) +
-                              nt_header->FileHeader.SizeOfOptionalHeader);
+// Search the code section for a wildcard signature.
+template <size_t N>
+uint8_t* SearchModuleRaw(HMODULE module, const BytePattern<N>& pattern) {
+  size_t size;
+  const uint8_t* text = GetModuleSection(module, ".text", &size);
+  return (uint8_t*)ParallelPatternSearch(text, size, pattern.view());
+}
 
-  for (int i = 0; i < nt_header->FileHeader.NumberOfSections; ++i) {
-    if (strcmp((const char*)section[i].Name, ".rdata") == 0) {
-      return memmem(buffer + section[i].PointerToRawData,
-                    section[i].SizeOfRawData, sub, m);
-      break;
-    }
+// Run every signature of `scanner` over one section in a single pass, split
+// into chunks like the searches above.
+bool ScanModuleSection(HMODULE module,
+                       const char* name,
+                       MultiPatternScanner& scanner) {
+  size_t size;
+  const uint8_t* section = GetModuleSection(module, name, &size);
+  if (!section)
+    return false;
+  scanner.ParallelScan(section, size);
+  return true;
+}
+
+bool WriteMemory(PBYTE BaseAddress, PBYTE Buffer, DWORD nSize) {
+  DWORD ProtectFlag = 0;
+  if (VirtualProtectEx(GetCurrentProcess(), BaseAddress, nSize,
+                       PAGE_EXECUTE_READWRITE, &ProtectFlag)) {
+    memcpy(BaseAddress, Buffer, nSize);
+    FlushInstructionCache(GetCurrentProcess(), BaseAddress, nSize);
+    VirtualProtectEx(GetCurrentProcess(), BaseAddress, nSize, ProtectFlag,
+                     &ProtectFlag);
+    return true;
   }
-  return nullptr;
+  return false;
 }
 
-// bool WriteMemory(PBYTE BaseAddress, PBYTE Buffer, DWORD nSize) {
-//   DWORD ProtectFlag = 0;
-//   if (VirtualProtectEx(GetCurrentProcess(), BaseAddress, nSize,
-//                        PAGE_EXECUTE_READWRITE, &ProtectFlag)) {
-//     memcpy(BaseAddress, Buffer, nSize);
-//     FlushInstructionCache(GetCurrentProcess(), BaseAddress, nSize);
-//     VirtualProtectEx(GetCurrentProcess(), BaseAddress, nSize, ProtectFlag,
-//                      &ProtectFlag);
-//     return true;
-//   }
-//   return false;
-// }
-
 // Path and file manipulation functions.
 // Get the directory where the application is located.
 std::wstring GetAppDir() {
@@ -0,0 +1,245 @@
+// Benchmark of the gzip codecs of pakfile.h on the entries of a pak.
+//
+//   codec_bench [--pak resources.pak] [--min KB]
+//
+// Every gzip entry of at least --min KB (10 by default, like the patcher) is
+// inflated, deflated into its own slot at levels 1, 6 and 9, and checksummed
+// by each codec, and the output of each codec is inflated again by the
+// others. Without --pak, synthetic HTML entries are compressed first. The
+// totals are reported as MB/s of inflated content.
+
+#include <windows.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+#include "pakfile.h"
+
+namespace {
+
+struct Entry {
+  const uint8_t* deflate;
+  size_t deflate_size;
+  size_t size;
+  size_t slot;
+};
+
+struct Totals {
+  double inflate = 0;
+  double deflate[3] = {};
+  double crc = 0;
+  size_t deflated[3] = {};
+  int failures = 0;
+};
+
+bool ReadFile(const char* path, std::vector<uint8_t>* data) {
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return false;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  data->resize(size > 0 ? (size_t)size : 0);
+  bool ok = fread(data->data(), 1, data->size(), file) == data->size();
+  fclose(file);
+  return ok;
+}
+
+// HTML-like content of 16 KB to 2 MB, deflated at level 6 into gzip
+// members the way Chrome's build does.
+std::vector<uint8_t> SyntheticEntries(GzipCodec* codec,
+                                      std::vector<Entry>* entries) {
+  std::mt19937 rng(20240601);
+  std::vector<std::vector<uint8_t>> members;
+  for (int i = 0; i < 64; ++i) {
+    std::string content;
+    size_t size = (16 << 10) + rng() % (2 << 20);
+    while (content.size() < size) {
+      content += "  <div class=\"row" + std::to_string(rng() % 5000) +
+                 "\">" + std::to_string(rng() % 100000) + "</div>\n";
+    }
+    std::vector<uint8_t> member(18 + content.size() + content.size() / 8);
+    size_t deflated =
+        codec->Deflate((const uint8_t*)content.data(), content.size(), 0, 6,
+                       member.data() + 10, member.size() - 18);
+    member.resize(18 + deflated);
+    const uint8_t header[10] = {0x1F, 0x8B, 0x08, 0, 0, 0, 0, 0, 0, 0xFF};
+    memcpy(member.data(), header, 10);
+    uint32_t crc = codec->Crc32(0, (const uint8_t*)content.data(),
+                                content.size());
+    uint32_t isize = (uint32_t)content.size();
+    memcpy(member.data() + 10 + deflated, &crc, 4);
+    memcpy(member.data() + 14 + deflated, &isize, 4);
+    members.push_back(std::move(member));
+  }
+
+  std::vector<uint8_t> buffer;
+  std::vector<size_t> offsets;
+  for (const auto& member : members) {
+    offsets.push_back(buffer.size());
+    buffer.insert(buffer.end(), member.begin(), member.end());
+  }
+  for (size_t i = 0; i < members.size(); ++i) {
+    const uint8_t* member = buffer.data() + offsets[i];
+    size_t size = members[i].size();
+    uint32_t isize;
+    memcpy(&isize, member + size - 4, 4);
+    entries->push_back({member + 10, size - 18, isize, size});
+  }
+  return buffer;
+}
+
+void LoadEntries(const PakReader& reader,
+                 size_t min_size,
+                 std::vector<Entry>* entries) {
+  for (size_t i = 0; i < reader.entry_count(); ++i) {
+    PakResource resource = reader.entry(i);
+    if (resource.size < min_size)
+      continue;
+    size_t header = GzipHeaderSize(resource.data, resource.size);
+    if (!header)
+      continue;
+    uint32_t isize;
+    memcpy(&isize, resource.data + resource.size - 4, 4);
+    entries->push_back({resource.data + header, resource.size - header - 8,
+                        isize, resource.size});
+  }
+}
+
+double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* pak_path = nullptr;
+  size_t min_size = 10 * 1024;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--pak") && i + 1 < argc) {
+      pak_path = argv[++i];
+    } else if (!strcmp(argv[i], "--min") && i + 1 < argc) {
+      min_size = (size_t)atoi(argv[++i]) << 10;
+    } else {
+      fprintf(stderr, "usage: %s [--pak resources.pak] [--min KB]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+
+  const char* kNames[] = {"miniz", "fast"};
+  std::vector<std::unique_ptr<GzipCodec>> codecs;
+  for (const char* name : kNames) {
+    codecs.push_back(CreateGzipCodec(name));
+  }
+
+  std::vector<uint8_t> file;
+  std::vector<Entry> entries;
+  if (pak_path) {
+    if (!ReadFile(pak_path, &file)) {
+      fprintf(stderr, "cannot read %s\n", pak_path);
+      return 1;
+    }
+    PakReader reader(file.data(), file.size());
+    if (!reader.valid()) {
+      fprintf(stderr, "%s is not a pak\n", pak_path);
+      return 1;
+    }
+    LoadEntries(reader, min_size, &entries);
+  } else {
+    file = SyntheticEntries(codecs[0].get(), &entries);
+  }
+
+  size_t total = 0;
+  size_t largest = 0;
+  size_t largest_slot = 0;
+  for (const Entry& entry : entries) {
+    total += entry.size;
+    largest = (std::max)(largest, entry.size);
+    largest_slot = (std::max)(largest_slot, entry.slot);
+  }
+  printf("%zu gzip entries, %.1f MB inflated\n\n", entries.size(),
+         total / 1e6);
+
+  const int kLevels[] = {1, 6, 9};
+  std::vector<uint8_t> content(largest);
+  std::vector<uint8_t> check(largest);
+  std::vector<uint8_t> deflated(largest_slot);
+  std::vector<DeflateBlock> blocks;
+  std::vector<Totals> totals(codecs.size());
+  using Clock = std::chrono::steady_clock;
+
+  for (const Entry& entry : entries) {
+    for (size_t c = 0; c < codecs.size(); ++c) {
+      GzipCodec* codec = codecs[c].get();
+      Totals& t = totals[c];
+
+      auto start = Clock::now();
+      bool ok = codec->Inflate(entry.deflate, entry.deflate_size,
+                               content.data(), entry.size, &blocks);
+      t.inflate += Seconds(start);
+      if (!ok) {
+        ++t.failures;
+        continue;
+      }
+
+      start = Clock::now();
+      codec->Crc32(0, content.data(), entry.size);
+      t.crc += Seconds(start);
+
+      for (int l = 0; l < 3; ++l) {
+        start = Clock::now();
+        size_t size = codec->Deflate(content.data(), entry.size, 0,
+                                     kLevels[l], deflated.data(),
+                                     entry.slot - 20);
+        t.deflate[l] += Seconds(start);
+        t.deflated[l] += size ? size : entry.deflate_size;
+        if (!size)
+          continue;
+        // Whatever one codec writes, the others must read.
+        for (auto& other : codecs) {
+          if (!other->Inflate(deflated.data(), size, check.data(), entry.size,
+                              &blocks) ||
+              memcmp(check.data(), content.data(), entry.size) != 0) {
+            ++t.failures;
+          }
+        }
+      }
+    }
+  }
+
+  printf("%-8s %10s %10s %10s %10s %10s   (MB/s)\n", "codec", "inflate",
+         "deflate 1", "deflate 6", "deflate 9", "crc32");
+  for (size_t c = 0; c < codecs.size(); ++c) {
+    const Totals& t = totals[c];
+    printf("%-8s %10.0f %10.0f %10.0f %10.0f %10.0f\n", codecs[c]->name(),
+           total / t.inflate / 1e6, total / t.deflate[0] / 1e6,
+           total / t.deflate[1] / 1e6, total / t.deflate[2] / 1e6,
+           total / t.crc / 1e6);
+  }
+  printf("\n%-8s %10s %10s %10s   (compressed MB)\n", "codec", "level 1",
+         "level 6", "level 9");
+  int failures = 0;
+  for (size_t c = 0; c < codecs.size(); ++c) {
+    const Totals& t = totals[c];
+    printf("%-8s %10.2f %10.2f %10.2f\n", codecs[c]->name(),
+           t.deflated[0] / 1e6, t.deflated[1] / 1e6, t.deflated[2] / 1e6);
+    failures += t.failures;
+  }
+  if (failures) {
+    printf("\n%d entries did not round-trip\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,922 @@
+// Offline pak tool on top of pakfile.h and pakrules.h, so that paks can be
+// checked and patched when Chrome is packaged instead of on every machine.
+//
+//   paktool list <pak>
+//   paktool extract <pak> <id> <file> [--raw]
+//   paktool verify <pak>
+//   paktool patch <pak> <rules> <out>
+//   paktool rebuild <pak> <rules> <out>
+//   paktool generate <out> [--entries N] [--version 4|5]
+//   paktool bench [--pak <pak>] [--entries N] [--version 4|5]
+//                 [--rules <rules>] [--repeat N]
+//   paktool determinism [--entries N] [--version 4|5] [--workers N]
+//                       [--repeat N]
+//   paktool splice
+//
+// patch rewrites the resources in their slots like the browser does, rebuild
+// writes the pak anew so that they may grow. Both apply the rules of the
+// pak_rules file whose pak= names the input file, or "locale" for a pak in a
+// locales directory. The built-in about page rule stays with the browser.
+//
+// bench times the phases of patching: the header check, inflating the
+// compressed resources, matching the rules against the content and
+// deflating it again, then a whole patch and rebuild. Without --pak it runs
+// on synthetic v4 and v5 paks of --entries resources, which generate
+// writes out.
+//
+// determinism patches and rebuilds synthetic paks on one worker and on
+// --workers, --repeat times, and fails unless every output is identical to
+// the serial one.
+//
+// splice patches synthetic content in its first, a middle and its last
+// deflate block, in and after a stored block, and in content that is stored
+// whole. Each patched content is spliced onto the original deflate data and
+// must inflate back to itself, and wherever there are blocks before the
+// patch to reuse they must be reused. Nothing here needs Windows, so this
+// builds with MSVC, GCC and Clang.
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+bool verbose = false;
+
+// The pak code reports through DebugLog, which utils.h provides in the DLL.
+void DebugLog(const wchar_t* format, ...) {
+  if (!verbose)
+    return;
+  wchar_t message[1024];
+  va_list args;
+  va_start(args, format);
+  vswprintf(message, sizeof(message) / sizeof(message[0]), format, args);
+  va_end(args);
+  std::string narrow;
+  for (const wchar_t* p = message; *p; ++p) {
+    narrow += *p < 0x80 ? (char)*p : '?';
+  }
+  fprintf(stderr, "%s\n", narrow.c_str());
+}
+
+#include "pakfile.h"
+#include "pakrules.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double Seconds(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+bool ReadWholeFile(const char* path, std::vector<uint8_t>* data) {
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return false;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  data->resize(size > 0 ? (size_t)size : 0);
+  bool ok = fread(data->data(), 1, data->size(), file) == data->size();
+  fclose(file);
+  return ok;
+}
+
+// Written as a whole to a temporary file first, like the cache of the
+// browser, so that a failed run never leaves half a pak behind.
+template <typename Writer>
+bool WriteWholeFile(const char* path, Writer write_content) {
+  std::string temp_path = std::string(path) + ".tmp";
+  FILE* file = fopen(temp_path.c_str(), "wb");
+  if (!file)
+    return false;
+  bool ok = write_content([&](const uint8_t* data, size_t size) {
+    return !size || fwrite(data, 1, size, file) == size;
+  });
+  ok = fclose(file) == 0 && ok;
+  remove(path);
+  if (!ok || rename(temp_path.c_str(), path) != 0) {
+    remove(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool LoadPak(const char* path, std::vector<uint8_t>* file) {
+  if (!ReadWholeFile(path, file)) {
+    fprintf(stderr, "cannot read %s\n", path);
+    return false;
+  }
+  if (!PakReader(file->data(), file->size()).valid()) {
+    fprintf(stderr, "%s is not a pak\n", path);
+    return false;
+  }
+  return true;
+}
+
+// The rules of the file at `path` that patch the pak at `pak_path`, chosen
+// the way the browser chooses them by file name.
+bool LoadRules(const char* path, const char* pak_path, PakRuleSet* rules) {
+  std::vector<uint8_t> text;
+  if (!ReadWholeFile(path, &text)) {
+    fprintf(stderr, "cannot read %s\n", path);
+    return false;
+  }
+  PakRuleSet parsed;
+  std::string error;
+  if (!ParsePakRules(std::string(text.begin(), text.end()), &parsed,
+                     &error)) {
+    fprintf(stderr, "%s: %s\n", path, error.c_str());
+    return false;
+  }
+
+  std::string lower = pak_path;
+  std::transform(lower.begin(), lower.end(), lower.begin(),
+                 [](unsigned char c) { return (char)tolower(c); });
+  std::replace(lower.begin(), lower.end(), '\\', '/');
+  size_t slash = lower.rfind('/');
+  std::string name =
+      slash == std::string::npos ? lower : lower.substr(slash + 1);
+  std::string directory =
+      slash == std::string::npos ? "" : lower.substr(0, slash);
+  size_t parent = directory.rfind('/');
+  bool in_locales =
+      (parent == std::string::npos ? directory
+                                   : directory.substr(parent + 1)) ==
+      "locales";
+
+  for (const auto& rule : parsed.rules()) {
+    if (rule.pak == name || (rule.pak == "locale" && in_locales))
+      rules->Add(rule);
+  }
+  if (rules->empty()) {
+    fprintf(stderr, "%s has no rules for %s\n", path, name.c_str());
+    return false;
+  }
+  return true;
+}
+
+const char* Compression(const PakResource& resource) {
+  if (IsBrotliResource(resource.data, resource.size))
+    return "brotli";
+  if (GzipHeaderSize(resource.data, resource.size))
+    return "gzip";
+  return "none";
+}
+
+// The decoded content of a gzip or brotli resource, the raw bytes of any
+// other. Gzip goes through `codec` like the patcher and must match its
+// CRC-32. False if the content does not decode to the size it declares.
+bool Decode(GzipCodec* codec,
+            const PakResource& resource,
+            std::vector<uint8_t>* content) {
+  content->clear();
+  size_t size = PakContentSize(resource);
+  if (!size) {
+    content->assign(resource.data, resource.data + resource.size);
+    return true;
+  }
+  if (size_t header = GzipHeaderSize(resource.data, resource.size)) {
+    uint32_t crc;
+    memcpy(&crc, resource.data + resource.size - 8, sizeof(crc));
+    content->resize(size);
+    std::vector<DeflateBlock> blocks;
+    return codec->Inflate(resource.data + header, resource.size - header - 8,
+                          content->data(), size, &blocks) &&
+           codec->Crc32(0, content->data(), size) == crc;
+  }
+  content->reserve(size);
+  PakStream(resource, 0, [&](const uint8_t* window, size_t length) {
+    content->insert(content->end(), window, window + length);
+    return content->size() > size;
+  });
+  return content->size() == size;
+}
+
+int List(const char* path) {
+  std::vector<uint8_t> file;
+  if (!LoadPak(path, &file))
+    return 1;
+  PakReader reader(file.data(), file.size());
+  printf("version %u, %zu entries, %zu aliases, %zu bytes\n\n",
+         reader.version(), reader.entry_count(), reader.alias_count(),
+         reader.size());
+  printf("%6s %10s %10s %-6s %10s %s\n", "id", "offset", "size", "codec",
+         "content", "type");
+  for (size_t i = 0; i < reader.entry_count(); ++i) {
+    PakResource resource = reader.entry(i);
+    size_t content_size = PakContentSize(resource);
+    // The type needs the start of the content only.
+    const char* type = PakResourceType(resource.data, resource.size);
+    if (content_size) {
+      type = "?";
+      PakStream(resource, 0, [&](const uint8_t* window, size_t length) {
+        type = PakResourceType(window, length);
+        return true;
+      });
+    }
+    printf("%6u %10zu %10u %-6s %10zu %s\n", resource.id,
+           (size_t)(resource.data - file.data()), resource.size,
+           Compression(resource), content_size ? content_size : resource.size,
+           type);
+  }
+  return 0;
+}
+
+int Extract(const char* path, const char* id, const char* out, bool raw) {
+  std::vector<uint8_t> file;
+  if (!LoadPak(path, &file))
+    return 1;
+  PakReader reader(file.data(), file.size());
+  PakResource resource;
+  if (!reader.FindById((uint16_t)strtoul(id, nullptr, 0), &resource)) {
+    fprintf(stderr, "%s has no resource %s\n", path, id);
+    return 1;
+  }
+  std::vector<uint8_t> content;
+  if (raw) {
+    content.assign(resource.data, resource.data + resource.size);
+  } else if (!Decode(CreateGzipCodec(kPakGzipCodec).get(), resource,
+                     &content)) {
+    fprintf(stderr, "resource %u does not decode\n", resource.id);
+    return 1;
+  }
+  if (!WriteWholeFile(out, [&](auto write) {
+        return write(content.data(), content.size());
+      })) {
+    fprintf(stderr, "cannot write %s\n", out);
+    return 1;
+  }
+  return 0;
+}
+
+// Every gzip resource must inflate to its ISIZE with a matching CRC-32 and
+// every brotli one to its declared size. Brotli is skipped unless built with
+// PAK_BROTLI.
+int Verify(const char* path) {
+  std::vector<uint8_t> file;
+  if (!LoadPak(path, &file))
+    return 1;
+  PakReader reader(file.data(), file.size());
+  auto codec = CreateGzipCodec(kPakGzipCodec);
+  std::vector<uint8_t> content;
+  size_t checked = 0;
+  size_t skipped = 0;
+  size_t failures = 0;
+  for (size_t i = 0; i < reader.entry_count(); ++i) {
+    PakResource resource = reader.entry(i);
+    if (!PakContentSize(resource))
+      continue;
+#ifndef PAK_BROTLI
+    if (IsBrotliResource(resource.data, resource.size)) {
+      ++skipped;
+      continue;
+    }
+#endif
+    ++checked;
+    if (!Decode(codec.get(), resource, &content)) {
+      printf("resource %u is corrupt\n", resource.id);
+      ++failures;
+    }
+  }
+  printf("%zu compressed resources checked, %zu brotli skipped, %zu "
+         "corrupt\n",
+         checked, skipped, failures);
+  return failures ? 1 : 0;
+}
+
+int Patch(const char* path, const char* rules_path, const char* out,
+          bool rebuild) {
+  std::vector<uint8_t> file;
+  PakRuleSet rules;
+  if (!LoadPak(path, &file) || !LoadRules(rules_path, path, &rules))
+    return 1;
+  PakReader reader(file.data(), file.size());
+  auto select = [&](const PakResource& resource) {
+    return rules.Selects(resource);
+  };
+  auto patch = [&](uint16_t id, uint8_t* data, uint32_t length,
+                   uint32_t& new_len) {
+    return PatchResource(rules, id, data, length, new_len);
+  };
+
+  std::vector<uint16_t> patched;
+  bool written;
+  if (rebuild) {
+    std::vector<std::vector<uint8_t>> rebuilt;
+    patched = RebuildGZIPFile(reader, select, patch, &rebuilt,
+                              rules.target_count());
+    written = !patched.empty() && WriteWholeFile(out, [&](auto write) {
+      return WriteRebuiltPak(reader, rebuilt, write);
+    });
+  } else {
+    patched = TraversalGZIPFile(reader, select, patch, rules.target_count());
+    written = !patched.empty() && WriteWholeFile(out, [&](auto write) {
+      return write(file.data(), file.size());
+    });
+  }
+  if (patched.empty()) {
+    fprintf(stderr, "no resource of %s was patched\n", path);
+    return 1;
+  }
+  if (!written) {
+    fprintf(stderr, "cannot write %s\n", out);
+    return 1;
+  }
+  printf("patched");
+  for (uint16_t id : patched) {
+    printf(" %u", id);
+  }
+  printf("\n");
+  return 0;
+}
+
+// A gzip member the way Chrome's build writes one.
+std::vector<uint8_t> GzipMember(GzipCodec* codec, const std::string& content) {
+  std::vector<uint8_t> member(18 + content.size() + content.size() / 8 + 64);
+  const uint8_t* data = (const uint8_t*)content.data();
+  size_t deflated = codec->Deflate(data, content.size(), 0, 9,
+                                   member.data() + 10, member.size() - 18);
+  member.resize(18 + deflated);
+  const uint8_t header[10] = {0x1F, 0x8B, 0x08, 0, 0, 0, 0, 0, 0, 0xFF};
+  memcpy(member.data(), header, 10);
+  uint32_t crc = codec->Crc32(0, data, content.size());
+  uint32_t size = (uint32_t)content.size();
+  memcpy(member.data() + 10 + deflated, &crc, 4);
+  memcpy(member.data() + 14 + deflated, &size, 4);
+  return member;
+}
+
+template <typename T>
+void Append(std::vector<uint8_t>* out, const T& value) {
+  const uint8_t* bytes = (const uint8_t*)&value;
+  out->insert(out->end(), bytes, bytes + sizeof(value));
+}
+
+// A pak of `count` resources with IDs from 1: mostly small raw ones like the
+// images of a real pak, every eighth gzip-compressed HTML of 12 to 300 KB,
+// one of which holds the marker of SyntheticRules(). Version 5 paks alias
+// every 64th ID to the resource before it.
+std::vector<uint8_t> SyntheticPak(uint32_t version, size_t count) {
+  std::mt19937 rng(20240601);
+  auto codec = CreateGzipCodec(kPakGzipCodec);
+  std::vector<std::vector<uint8_t>> resources;
+  for (size_t i = 0; i < count; ++i) {
+    if (i % 8 != 7) {
+      std::vector<uint8_t> raw(64 + rng() % 4096);
+      for (auto& byte : raw) {
+        byte = (uint8_t)rng();
+      }
+      resources.push_back(std::move(raw));
+      continue;
+    }
+    std::string html = "<!doctype html>\n";
+    if (i == 7)
+      html += "<synthetic-page>\n  <div hidden=\"false\"></div>\n";
+    size_t size = (12 << 10) + rng() % (288 << 10);
+    while (html.size() < size) {
+      html += "  <div class=\"row" + std::to_string(rng() % 5000) + "\">" +
+              std::to_string(rng() % 100000) + "</div>\n";
+    }
+    if (i == 7)
+      html += "</synthetic-page>\n";
+    resources.push_back(GzipMember(codec.get(), html));
+  }
+
+  std::vector<PAK_ALIAS> aliases;
+  if (version == PACK5_FILE_VERSION) {
+    for (size_t i = 1; i < count; i += 64) {
+      aliases.push_back({(uint16_t)(count + 1 + i), (uint16_t)(i - 1)});
+    }
+  }
+
+  std::vector<uint8_t> pak;
+  Append(&pak, version);
+  if (version == PACK4_FILE_VERSION) {
+    Append(&pak, PAK4_HEADER{(uint32_t)count, 1});
+  } else {
+    Append(&pak, PAK5_HEADER{1, (uint16_t)count, (uint16_t)aliases.size()});
+  }
+  size_t offset = pak.size() + (count + 1) * sizeof(PAK_ENTRY) +
+                  aliases.size() * sizeof(PAK_ALIAS);
+  for (size_t i = 0; i <= count; ++i) {
+    Append(&pak, PAK_ENTRY{(uint16_t)(i < count ? i + 1 : 0),
+                           (uint32_t)offset});
+    if (i < count)
+      offset += resources[i].size();
+  }
+  for (const auto& alias : aliases) {
+    Append(&pak, alias);
+  }
+  for (const auto& resource : resources) {
+    pak.insert(pak.end(), resource.begin(), resource.end());
+  }
+  return pak;
+}
+
+PakRuleSet SyntheticRules() {
+  PakRule rule;
+  rule.name = "synthetic";
+  rule.marker = "</synthetic-page>";
+  rule.compress_html = true;
+  rule.replacements.push_back({R"(hidden="false")", R"(hidden="true")"});
+  PakRuleSet rules;
+  rules.Add(rule);
+  return rules;
+}
+
+struct BenchOptions {
+  const char* pak = nullptr;
+  const char* rules = nullptr;
+  size_t entries = 4000;
+  uint32_t version = 0;
+  size_t workers = 0;
+  int repeat = 5;
+};
+
+void BenchPak(const char* name,
+              std::vector<uint8_t> file,
+              const PakRuleSet& rules,
+              int repeat) {
+  // The best of `repeat` runs of each phase.
+  auto best = [&](auto phase) {
+    double seconds = 0;
+    for (int i = 0; i < repeat; ++i) {
+      auto start = Clock::now();
+      phase();
+      double elapsed = Seconds(start);
+      seconds = i ? (std::min)(seconds, elapsed) : elapsed;
+    }
+    return seconds;
+  };
+
+  double header = best([&]() {
+    for (int i = 0; i < 1000; ++i) {
+      PakReader reader(file.data(), file.size());
+      if (!reader.valid())
+        abort();
+    }
+  }) / 1000;
+  PakReader reader(file.data(), file.size());
+
+  // The resources the patcher would consider, decoded once for the match
+  // and deflate phases.
+  std::vector<PakResource> resources;
+  size_t compressed = 0;
+  size_t inflated = 0;
+  for (size_t i = 0; i < reader.entry_count(); ++i) {
+    PakResource resource = reader.entry(i);
+    if (resource.size >= 10 * 1024 && PakContentSize(resource)) {
+      resources.push_back(resource);
+      compressed += resource.size;
+      inflated += PakContentSize(resource);
+    }
+  }
+  std::vector<std::vector<uint8_t>> contents(resources.size());
+  auto codec = CreateGzipCodec(kPakGzipCodec);
+  double inflate = best([&]() {
+    for (size_t i = 0; i < resources.size(); ++i) {
+      Decode(codec.get(), resources[i], &contents[i]);
+    }
+  });
+
+  size_t selected = 0;
+  double select = best([&]() {
+    selected = 0;
+    for (const PakResource& resource : resources) {
+      selected += rules.Selects(resource);
+    }
+  });
+  std::string patched;
+  double match = best([&]() {
+    for (size_t i = 0; i < resources.size(); ++i) {
+      rules.Apply(resources[i].id, contents[i].data(), contents[i].size(),
+                  &patched);
+    }
+  });
+
+  PakPatchArena arena;
+  double deflate = best([&]() {
+    for (size_t i = 0; i < resources.size(); ++i) {
+      arena.Reserve(contents[i].size(), resources[i].size);
+      DeflateToFit(arena, contents[i].data(), contents[i].size(), 0,
+                   arena.deflated.data(),
+                   resources[i].size - kGzipSlotOverhead);
+    }
+  });
+
+  auto select_rules = [&](const PakResource& resource) {
+    return rules.Selects(resource);
+  };
+  auto patch = [&](uint16_t id, uint8_t* data, uint32_t length,
+                   uint32_t& new_len) {
+    return PatchResource(rules, id, data, length, new_len);
+  };
+  size_t patched_count = 0;
+  double in_place = best([&]() {
+    std::vector<uint8_t> copy = file;
+    PakReader copy_reader(copy.data(), copy.size());
+    patched_count =
+        TraversalGZIPFile(copy_reader, select_rules, patch,
+                          rules.target_count())
+            .size();
+  });
+  size_t rebuilt_size = 0;
+  double rebuild = best([&]() {
+    std::vector<std::vector<uint8_t>> rebuilt;
+    RebuildGZIPFile(reader, select_rules, patch, &rebuilt,
+                    rules.target_count());
+    rebuilt_size = 0;
+    WriteRebuiltPak(reader, rebuilt, [&](const uint8_t*, size_t size) {
+      rebuilt_size += size;
+      return true;
+    });
+  });
+
+  printf("%s: v%u, %zu entries, %.1f MB, %zu compressed resources of %.1f "
+         "MB inflating to %.1f MB, %zu selected, %zu patched\n",
+         name, reader.version(), reader.entry_count(), file.size() / 1e6,
+         resources.size(), compressed / 1e6, inflated / 1e6, selected,
+         patched_count);
+  printf("  %-12s %10.3f ms\n", "header", header * 1e3);
+  printf("  %-12s %10.3f ms %8.0f MB/s\n", "inflate", inflate * 1e3,
+         inflated / inflate / 1e6);
+  printf("  %-12s %10.3f ms\n", "select", select * 1e3);
+  printf("  %-12s %10.3f ms %8.0f MB/s\n", "match", match * 1e3,
+         inflated / match / 1e6);
+  printf("  %-12s %10.3f ms %8.0f MB/s\n", "deflate", deflate * 1e3,
+         inflated / deflate / 1e6);
+  printf("  %-12s %10.3f ms\n", "patch", in_place * 1e3);
+  printf("  %-12s %10.3f ms, %.1f MB written\n\n", "rebuild", rebuild * 1e3,
+         rebuilt_size / 1e6);
+}
+
+int Bench(const BenchOptions& options) {
+  PakRuleSet rules;
+  if (options.rules) {
+    if (!LoadRules(options.rules, options.pak ? options.pak : "resources.pak",
+                   &rules)) {
+      return 1;
+    }
+  } else {
+    rules = SyntheticRules();
+  }
+
+  if (options.pak) {
+    std::vector<uint8_t> file;
+    if (!LoadPak(options.pak, &file))
+      return 1;
+    BenchPak(options.pak, std::move(file), rules, options.repeat);
+    return 0;
+  }
+  if (!options.entries || options.entries > 0xFFFF / 2) {
+    fprintf(stderr, "--entries must be 1 to %d\n", 0xFFFF / 2);
+    return 2;
+  }
+  for (uint32_t version : {PACK4_FILE_VERSION, PACK5_FILE_VERSION}) {
+    if (options.version && options.version != version)
+      continue;
+    BenchPak("synthetic", SyntheticPak(version, options.entries), rules,
+             options.repeat);
+  }
+  return 0;
+}
+
+int Generate(const char* out, const BenchOptions& options) {
+  if (!options.entries || options.entries > 0xFFFF / 2) {
+    fprintf(stderr, "--entries must be 1 to %d\n", 0xFFFF / 2);
+    return 2;
+  }
+  std::vector<uint8_t> pak = SyntheticPak(
+      options.version ? options.version : PACK5_FILE_VERSION, options.entries);
+  if (!WriteWholeFile(out, [&](auto write) {
+        return write(pak.data(), pak.size());
+      })) {
+    fprintf(stderr, "cannot write %s\n", out);
+    return 1;
+  }
+  return 0;
+}
+
+// Rules for the determinism check. The first selects the HTML resources
+// that hold a rare number, so the scan cannot stop early; the second selects
+// a few resources by ID, so it stops once they are done. Both collapse the
+// indentation, or the patched content would not fit in place.
+std::vector<PakRuleSet> DeterminismRules() {
+  PakRule rare;
+  rare.name = "marker";
+  rare.type = "html";
+  rare.marker = ">99999<";
+  rare.compress_html = true;
+  rare.replacements.push_back({">99999</div>", ">rare</div>"});
+
+  PakRuleSet by_id;
+  for (uint16_t id : {8, 64, 512, 2048}) {
+    PakRule rule;
+    rule.name = "id";
+    rule.id = id;
+    rule.compress_html = true;
+    rule.replacements.push_back({"<!doctype html>", "<!DOCTYPE html>"});
+    if (id == 8) {
+      rule.replacements.push_back(
+          {"</synthetic-page>", "</synthetic-page>\n<!-- patched -->"});
+    }
+    by_id.Add(rule);
+  }
+
+  std::vector<PakRuleSet> rules(1);
+  rules[0].Add(rare);
+  rules.push_back(by_id);
+  return rules;
+}
+
+// The pak that patch or rebuild writes for `file` on `workers` threads.
+std::vector<uint8_t> PatchedPak(std::vector<uint8_t> file,
+                                const PakRuleSet& rules,
+                                bool rebuild,
+                                size_t workers,
+                                std::vector<uint16_t>* patched) {
+  PakReader reader(file.data(), file.size());
+  auto select = [&](const PakResource& resource) {
+    return rules.Selects(resource);
+  };
+  auto patch = [&](uint16_t id, uint8_t* data, uint32_t length,
+                   uint32_t& new_len) {
+    return PatchResource(rules, id, data, length, new_len);
+  };
+  if (!rebuild) {
+    *patched = TraversalGZIPFile(reader, select, patch, rules.target_count(),
+                                 workers);
+    return file;
+  }
+
+  std::vector<std::vector<uint8_t>> rebuilt;
+  *patched = RebuildGZIPFile(reader, select, patch, &rebuilt,
+                             rules.target_count(), workers);
+  std::vector<uint8_t> out;
+  WriteRebuiltPak(reader, rebuilt, [&](const uint8_t* data, size_t size) {
+    out.insert(out.end(), data, data + size);
+    return true;
+  });
+  return out;
+}
+
+int Determinism(const BenchOptions& options) {
+  if (!options.entries || options.entries > 0xFFFF / 2) {
+    fprintf(stderr, "--entries must be 1 to %d\n", 0xFFFF / 2);
+    return 2;
+  }
+  // More workers than cores still interleave, which is what is tested.
+  size_t workers = options.workers
+                       ? options.workers
+                       : (std::max)(DefaultWorkerCount(), (size_t)4);
+  int failures = 0;
+  for (uint32_t version : {PACK4_FILE_VERSION, PACK5_FILE_VERSION}) {
+    if (options.version && options.version != version)
+      continue;
+    std::vector<uint8_t> pak = SyntheticPak(version, options.entries);
+    for (const PakRuleSet& rules : DeterminismRules()) {
+      for (bool rebuild : {false, true}) {
+        std::vector<uint16_t> expected_ids;
+        std::vector<uint8_t> expected =
+            PatchedPak(pak, rules, rebuild, 1, &expected_ids);
+        const char* result = expected_ids.empty() ? "nothing patched" : "ok";
+        for (int i = 0; i < options.repeat && !expected_ids.empty(); ++i) {
+          std::vector<uint16_t> ids;
+          std::vector<uint8_t> actual =
+              PatchedPak(pak, rules, rebuild, workers, &ids);
+          if (ids != expected_ids || actual.size() != expected.size() ||
+              memcmp(actual.data(), expected.data(), actual.size())) {
+            result = "differs";
+            break;
+          }
+        }
+        printf("v%u %-6s %-7s %3zu patched, 1 and %zu workers: %s\n",
+               version, rules.rules()[0].name.c_str(),
+               rebuild ? "rebuild" : "patch", expected_ids.size(), workers,
+               result);
+        failures += strcmp(result, "ok") != 0;
+      }
+    }
+  }
+  return failures ? 1 : 0;
+}
+
+// Indented HTML of `size` bytes, with `noise` random bytes from `noise_at`
+// that deflate stores rather than compresses.
+std::string SpliceContent(size_t size, size_t noise_at, size_t noise) {
+  std::mt19937 rng(20240603);
+  std::string html;
+  while (html.size() < size) {
+    html += "  <div class=\"row" + std::to_string(rng() % 5000) + "\">" +
+            std::to_string(rng() % 100000) + "</div>\n";
+  }
+  html.resize(size);
+  for (size_t i = noise_at; i < noise_at + noise && i < size; ++i) {
+    html[i] = (char)rng();
+  }
+  return html;
+}
+
+// BTYPE of the deflate block at `bit_offset`, 0 for a stored block.
+int DeflateBlockType(const uint8_t* deflate, size_t bit_offset) {
+  int type = 0;
+  for (size_t i = 0; i < 2; ++i) {
+    size_t bit = bit_offset + 1 + i;
+    type |= ((deflate[bit / 8] >> (bit % 8)) & 1) << i;
+  }
+  return type;
+}
+
+struct SpliceCase {
+  const char* name;
+  size_t at;
+  bool reuses;
+};
+
+// Patch `content` at each of `cases`, splice it onto `compressed` and check
+// that it inflates back to the patched content. Returns the failures.
+int CheckSplice(const char* name,
+                const std::string& content,
+                const std::vector<uint8_t>& compressed,
+                const std::vector<SpliceCase>& cases) {
+  int failures = 0;
+  for (const SpliceCase& splice : cases) {
+    std::string patched = content;
+    patched.replace(splice.at, 4, "<!-- spliced -->");
+
+    PakPatchArena arena;
+    size_t capacity = StoredDeflateSize(patched.size());
+    arena.Reserve(patched.size(), capacity);
+    const uint8_t* data = (const uint8_t*)patched.data();
+    const char* result = "ok";
+    if (!arena.codec->Inflate(compressed.data(), compressed.size(),
+                              arena.original.data(), content.size(),
+                              &arena.blocks) ||
+        memcmp(arena.original.data(), content.data(), content.size())) {
+      result = "original does not inflate";
+    } else {
+      size_t unchanged = std::mismatch(data, data + patched.size(),
+                                       arena.original.data())
+                             .first -
+                         data;
+      size_t size =
+          SpliceDeflate(arena, compressed.data(), data, patched.size(),
+                        unchanged, arena.deflated.data(), capacity);
+      std::vector<DeflateBlock> blocks;
+      std::vector<uint8_t> inflated(patched.size());
+      if (!size != !splice.reuses) {
+        result = splice.reuses ? "blocks not reused" : "reused blocks";
+      } else if (size &&
+                 (!arena.codec->Inflate(arena.deflated.data(), size,
+                                        inflated.data(), inflated.size(),
+                                        &blocks) ||
+                  memcmp(inflated.data(), data, inflated.size()))) {
+        result = "does not round-trip";
+      }
+    }
+    printf("%-7s %-22s at %7zu: %s\n", name, splice.name, splice.at, result);
+    failures += strcmp(result, "ok") != 0;
+  }
+  return failures;
+}
+
+int Splice() {
+  auto codec = CreateGzipCodec(kPakGzipCodec);
+  int failures = 0;
+
+  // Compressed blocks only, and with a stored block in the middle.
+  for (size_t noise : {0, 48 << 10}) {
+    size_t noise_at = 200 << 10;
+    std::string content = SpliceContent(400 << 10, noise_at, noise);
+    std::vector<uint8_t> compressed(StoredDeflateSize(content.size()));
+    compressed.resize(codec->Deflate((const uint8_t*)content.data(),
+                                     content.size(), 0, 9, compressed.data(),
+                                     compressed.size()));
+    std::vector<DeflateBlock> blocks;
+    std::vector<uint8_t> inflated(content.size());
+    codec->Inflate(compressed.data(), compressed.size(), inflated.data(),
+                   inflated.size(), &blocks);
+    if (blocks.size() < 3) {
+      printf("%zu deflate blocks, the checks need 3\n", blocks.size());
+      return 1;
+    }
+    const DeflateBlock& middle = blocks[blocks.size() / 2];
+    std::vector<SpliceCase> cases = {
+        {"first block", blocks[1].output_offset / 2, false},
+        {"middle block", middle.output_offset + 100, true},
+        {"middle block start", middle.output_offset, true},
+        {"last block", content.size() - 100, true},
+    };
+    if (noise) {
+      auto stored = std::find_if(
+          blocks.begin() + 1, blocks.end() - 1, [&](const DeflateBlock& block) {
+            return !DeflateBlockType(compressed.data(), block.bit_offset);
+          });
+      if (stored == blocks.end() - 1) {
+        printf("the noise was not stored\n");
+        return 1;
+      }
+      cases.push_back({"stored block", stored->output_offset + 100, true});
+      cases.push_back({"after stored block", stored[1].output_offset + 100,
+                       true});
+    }
+    failures += CheckSplice(noise ? "mixed" : "deflate", content, compressed,
+                            cases);
+  }
+
+  // Content stored whole, as the patcher writes it when that fits.
+  std::string content = SpliceContent(200 << 10, 0, 0);
+  std::vector<uint8_t> compressed(StoredDeflateSize(content.size()));
+  WriteStoredDeflate(compressed.data(), (const uint8_t*)content.data(),
+                     content.size());
+  failures += CheckSplice("stored", content, compressed,
+                          {{"first stored block", 100, false},
+                           {"middle stored block", 100 << 10, true},
+                           {"last stored block", content.size() - 100, true}});
+  return failures ? 1 : 0;
+}
+
+int Usage(const char* program) {
+  fprintf(stderr,
+          "usage: %s list <pak>\n"
+          "       %s extract <pak> <id> <file> [--raw]\n"
+          "       %s verify <pak>\n"
+          "       %s patch <pak> <rules> <out>\n"
+          "       %s rebuild <pak> <rules> <out>\n"
+          "       %s generate <out> [--entries N] [--version 4|5]\n"
+          "       %s bench [--pak <pak>] [--entries N] [--version 4|5]\n"
+          "                [--rules <rules>] [--repeat N]\n"
+          "       %s determinism [--entries N] [--version 4|5] [--workers N]\n"
+          "                      [--repeat N]\n"
+          "       %s splice\n"
+          "options: --verbose logs what the patcher skips\n",
+          program, program, program, program, program, program, program,
+          program, program);
+  return 2;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::vector<const char*> args;
+  bool raw = false;
+  BenchOptions bench;
+  for (int i = 1; i < argc; ++i) {
+    bool has_value = i + 1 < argc;
+    if (!strcmp(argv[i], "--verbose")) {
+      verbose = true;
+    } else if (!strcmp(argv[i], "--raw")) {
+      raw = true;
+    } else if (!strcmp(argv[i], "--pak") && has_value) {
+      bench.pak = argv[++i];
+    } else if (!strcmp(argv[i], "--rules") && has_value) {
+      bench.rules = argv[++i];
+    } else if (!strcmp(argv[i], "--entries") && has_value) {
+      bench.entries = (size_t)atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--version") && has_value) {
+      bench.version = (uint32_t)atoi(argv[++i]);
+      if (bench.version != PACK4_FILE_VERSION &&
+          bench.version != PACK5_FILE_VERSION) {
+        return Usage(argv[0]);
+      }
+    } else if (!strcmp(argv[i], "--workers") && has_value) {
+      bench.workers = (size_t)(std::max)(1, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "--repeat") && has_value) {
+      bench.repeat = (std::max)(1, atoi(argv[++i]));
+    } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+      return Usage(argv[0]);
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+  if (args.empty())
+    return Usage(argv[0]);
+
+  std::string command = args[0];
+  if (command == "list" && args.size() == 2)
+    return List(args[1]);
+  if (command == "extract" && args.size() == 4)
+    return Extract(args[1], args[2], args[3], raw);
+  if (command == "verify" && args.size() == 2)
+    return Verify(args[1]);
+  if ((command == "patch" || command == "rebuild") && args.size() == 4)
+    return Patch(args[1], args[2], args[3], command == "rebuild");
+  if (command == "generate" && args.size() == 2)
+    return Generate(args[1], bench);
+  if (command == "bench" && args.size() == 1)
+    return Bench(bench);
+  if (command == "determinism" && args.size() == 1)
+    return Determinism(bench);
+  if (command == "splice" && args.size() == 1)
+    return Splice();
+  return Usage(argv[0]);
+}
@@ -0,0 +1,422 @@
+// Benchmark of the substring search kernels in fastsearch.h.
+//
+//   search_bench [--pe chrome.dll] [--html file] [--size MB] [--cases N]
+//
+// The parallel searches and MultiPatternScanner::ParallelScan are first
+// compared against serial scans on --cases random inputs over the parallel
+// threshold, with needles planted across chunk boundaries and 1 to 8
+// workers. Then every kernel runs over each corpus with needles of 1 to 64
+// bytes that are found early, found late or missing. Results are checked
+// against the reference search, and the throughput and the worst-case time
+// ratio versus the reference are reported. The kernels are header-only and
+// portable, so this builds with MSVC, GCC and Clang.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "fastsearch.h"
+#include "multisearch.h"
+#include "parallel.h"
+#include "peimage.h"
+
+namespace {
+
+struct Corpus {
+  std::string name;
+  std::vector<uint8_t> data;
+};
+
+struct Kernel {
+  const char* name;
+  std::function<const uint8_t*(const uint8_t*, size_t, const uint8_t*, size_t)>
+      search;
+  size_t min_needle;
+  size_t max_needle;
+};
+
+const uint8_t* ReferenceSearch(const uint8_t* s,
+                               size_t n,
+                               const uint8_t* p,
+                               size_t m) {
+#if defined(__GLIBC__) || defined(__APPLE__)
+  return (const uint8_t*)::memmem(s, n, p, m);
+#else
+  const uint8_t* end = s + n;
+  const uint8_t* hit = std::search(s, end, std::boyer_moore_horspool_searcher(
+                                               p, p + m));
+  return hit == end ? nullptr : hit;
+#endif
+}
+
+// The kernels FastSearch replaced, benchmarked for comparison.
+const uint8_t* ForceSearch(const uint8_t* s, int n, const uint8_t* p) {
+  // The CRT memchr is already vectorized.
+  return (const uint8_t*)memchr(s, *p, n);
+}
+
+const uint8_t* SundaySearch(const uint8_t* s,
+                            int n,
+                            const uint8_t* p,
+                            int m) {
+  int i, j;
+
+  size_t skip[256];
+
+  for (i = 0; i < 256; ++i) {
+    skip[i] = m + 1;
+  }
+
+  for (i = 0; i < m; ++i) {
+    skip[p[i]] = m - i;
+  }
+
+  i = 0;
+  while (i <= n - m) {
+    j = 0;
+    while (s[i + j] == p[j]) {
+      ++j;
+      if (j >= m) {
+        return s + i;
+      }
+    }
+
+    i += (int)skip[s[i + m]];
+  }
+
+  return nullptr;
+}
+
+// Every position where `pattern` matches, one byte at a time.
+std::vector<const uint8_t*> ReferenceMatches(const uint8_t* s,
+                                             size_t n,
+                                             const PatternView& pattern) {
+  std::vector<const uint8_t*> matches;
+  for (size_t i = 0; i + pattern.size <= n; ++i) {
+    size_t j = 0;
+    while (j < pattern.size &&
+           (s[i + j] & (pattern.mask ? pattern.mask[j] : 0xFF)) ==
+               pattern.value[j]) {
+      ++j;
+    }
+    if (j == pattern.size)
+      matches.push_back(s + i);
+  }
+  return matches;
+}
+
+// Copy `pattern` to `at`, with random bytes under its wildcards.
+void Plant(uint8_t* at, const PatternView& pattern, std::mt19937& rng) {
+  for (size_t j = 0; j < pattern.size; ++j) {
+    uint8_t mask = pattern.mask ? pattern.mask[j] : 0xFF;
+    at[j] = pattern.value[j] | ((uint8_t)rng() & ~mask);
+  }
+}
+
+int CheckParallel(int cases) {
+  // Keyed on a pair of fixed bytes, and on none.
+  static constexpr auto kWildcard = ParsePattern("5A ?? 3C 7E 4? ?? 9D");
+  static constexpr auto kSparse = ParsePattern("C4 ?? ?? 9D ?? 1?");
+
+  std::mt19937 rng(20240602);
+  std::vector<uint8_t> base(kParallelSearchThreshold + 8 * kSearchChunkSize);
+  for (auto& c : base)
+    c = (uint8_t)rng();
+
+  int failures = 0;
+  for (int i = 0; i < cases; ++i) {
+    size_t n = kParallelSearchThreshold +
+               rng() % (base.size() - kParallelSearchThreshold + 1);
+    std::vector<uint8_t> data(base.begin(), base.begin() + n);
+    std::vector<uint8_t> needle(1 + rng() % 64);
+    for (auto& c : needle)
+      c = (uint8_t)rng();
+    PatternView patterns[] = {ExactPattern(needle.data(), needle.size()),
+                              kWildcard.view(), kSparse.view()};
+
+    // A few copies of each that start up to their length before a chunk
+    // boundary, so that some straddle it, start on it or end on it.
+    size_t chunks = n / kSearchChunkSize;
+    for (const PatternView& pattern : patterns) {
+      for (int copies = rng() % 4; copies > 0; --copies) {
+        size_t boundary = (1 + rng() % chunks) * kSearchChunkSize;
+        size_t at = boundary - rng() % (pattern.size + 1);
+        if (at + pattern.size <= n)
+          Plant(data.data() + at, pattern, rng);
+      }
+    }
+
+    const uint8_t* s = data.data();
+    size_t workers = 1 + rng() % 8;
+    MultiPatternScanner serial;
+    MultiPatternScanner parallel;
+    for (const PatternView& pattern : patterns) {
+      serial.Add(pattern);
+      parallel.Add(pattern);
+    }
+    serial.Scan(s, n);
+    parallel.ParallelScan(s, n, workers);
+
+    for (size_t k = 0; k < std::size(patterns); ++k) {
+      auto expected = ReferenceMatches(s, n, patterns[k]);
+      const uint8_t* first = expected.empty() ? nullptr : expected.front();
+      const uint8_t* found =
+          k ? ParallelPatternSearch(s, n, patterns[k], workers)
+            : ParallelSearch(s, n, needle.data(), needle.size(), workers);
+      if (found != first || serial.matches(k) != expected ||
+          parallel.matches(k) != expected) {
+        printf("pattern %zu of case %d (%zu bytes, %zu workers) differs\n", k,
+               i, n, workers);
+        ++failures;
+      }
+    }
+  }
+  printf("%d parallel cases checked against the reference, %d differ\n\n",
+         cases, failures);
+  return failures;
+}
+
+bool ReadFile(const char* path, std::vector<uint8_t>* data) {
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return false;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  data->resize(size > 0 ? (size_t)size : 0);
+  bool ok = fread(data->data(), 1, data->size(), file) == data->size();
+  fclose(file);
+  return ok;
+}
+
+Corpus RandomCorpus(size_t size, std::mt19937& rng) {
+  Corpus corpus{"random", std::vector<uint8_t>(size)};
+  for (auto& c : corpus.data)
+    c = (uint8_t)rng();
+  return corpus;
+}
+
+// Short runs of code between long zero-filled gaps, like section padding.
+Corpus ZeroPaddedCorpus(size_t size, std::mt19937& rng) {
+  Corpus corpus{"zero-padded", std::vector<uint8_t>(size, 0)};
+  for (size_t block = 0; block < size; block += 64 * 1024) {
+    size_t end = (std::min)(size, block + 512);
+    for (size_t i = block; i < end; ++i)
+      corpus.data[i] = (uint8_t)rng();
+  }
+  return corpus;
+}
+
+// A stand-in for the settings bundle when no real file is given.
+Corpus SyntheticHtmlCorpus(size_t size) {
+  static const char kRow[] =
+      "    <div class=\"settings-row\">\n"
+      "      <cr-toggle id=\"toggle\" checked=\"[[pref.value]]\">\n"
+      "      </cr-toggle>\n"
+      "    </div>\n";
+  Corpus corpus{"html (synthetic)", {}};
+  while (corpus.data.size() < size) {
+    corpus.data.insert(corpus.data.end(), kRow, kRow + sizeof(kRow) - 1);
+  }
+  corpus.data.resize(size);
+  return corpus;
+}
+
+bool LoadPeText(const char* path, Corpus* corpus) {
+  std::vector<uint8_t> file;
+  if (!ReadFile(path, &file))
+    return false;
+  PeImage image(file.data(), file.size(), PeImage::Layout::kFile);
+  size_t size;
+  const uint8_t* text = image.SectionData(".text", &size);
+  if (!image.valid() || !text)
+    return false;
+  corpus->name = std::string("pe .text (") + path + ")";
+  corpus->data.assign(text, text + size);
+  return true;
+}
+
+double TimeSearch(const Kernel& kernel,
+                  const Corpus& corpus,
+                  const std::vector<uint8_t>& needle,
+                  const uint8_t** result) {
+  using Clock = std::chrono::steady_clock;
+  double best = 1e30;
+  auto deadline = Clock::now() + std::chrono::milliseconds(100);
+  for (int round = 0; round < 50; ++round) {
+    auto start = Clock::now();
+    *result = kernel.search(corpus.data.data(), corpus.data.size(),
+                            needle.data(), needle.size());
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    best = (std::min)(best, elapsed);
+    if (round >= 2 && Clock::now() > deadline)
+      break;
+  }
+  return best;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* pe_path = nullptr;
+  const char* html_path = nullptr;
+  size_t size = 64 << 20;
+  int cases = 200;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--pe") && i + 1 < argc) {
+      pe_path = argv[++i];
+    } else if (!strcmp(argv[i], "--html") && i + 1 < argc) {
+      html_path = argv[++i];
+    } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+      size = (size_t)atoi(argv[++i]) << 20;
+    } else if (!strcmp(argv[i], "--cases") && i + 1 < argc) {
+      cases = atoi(argv[++i]);
+    } else {
+      fprintf(stderr,
+              "usage: %s [--pe chrome.dll] [--html file] [--size MB] "
+              "[--cases N]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+
+  int failures = CheckParallel(cases);
+
+  std::mt19937 rng(20240601);
+  std::vector<Corpus> corpora;
+  corpora.push_back(RandomCorpus(size, rng));
+  corpora.push_back(ZeroPaddedCorpus(size, rng));
+  Corpus loaded;
+  if (pe_path) {
+    if (LoadPeText(pe_path, &loaded)) {
+      corpora.push_back(loaded);
+    } else {
+      fprintf(stderr, "cannot read the .text section of %s\n", pe_path);
+    }
+  }
+  if (html_path && ReadFile(html_path, &loaded.data)) {
+    loaded.name = std::string("html (") + html_path + ")";
+    corpora.push_back(loaded);
+  } else {
+    corpora.push_back(SyntheticHtmlCorpus(size));
+  }
+
+  // SundaySearch reads one byte past the last candidate.
+  for (auto& corpus : corpora) {
+    corpus.data.push_back(0);
+    corpus.data.pop_back();
+  }
+
+  std::vector<Kernel> kernels = {
+      {"reference", ReferenceSearch, 1, 64},
+      {"FastSearch",
+       [](const uint8_t* s, size_t n, const uint8_t* p, size_t m) {
+         return FastSearch(s, (int)n, p, (int)m);
+       },
+       1, 64},
+      {"ForceSearch",
+       [](const uint8_t* s, size_t n, const uint8_t* p, size_t) {
+         return ForceSearch(s, (int)n, p);
+       },
+       1, 1},
+      {"SundaySearch",
+       [](const uint8_t* s, size_t n, const uint8_t* p, size_t m) {
+         return SundaySearch(s, (int)n, p, (int)m);
+       },
+       1, 64},
+      {"TwoWaySearch", TwoWaySearch, 1, 64},
+#ifdef FASTSEARCH_X86
+      {"Sse2Search", Sse2Search, 2, 64},
+#endif
+      {"ParallelSearch",
+       [](const uint8_t* s, size_t n, const uint8_t* p, size_t m) {
+         return ParallelSearch(s, n, p, m);
+       },
+       1, 64},
+  };
+#ifdef FASTSEARCH_X86
+  if (CpuSupportsAvx2())
+    kernels.push_back({"Avx2Search", Avx2Search, 2, 64});
+#endif
+
+  const size_t kNeedleSizes[] = {1, 2, 3, 4, 8, 16, 32, 64};
+  const char* kCases[] = {"hit-early", "hit-late", "miss"};
+  std::vector<double> worst_ratio(kernels.size(), 0);
+
+  printf("%-18s %-5s %-10s", "corpus", "len", "case");
+  for (const auto& kernel : kernels)
+    printf(" %14s", kernel.name);
+  printf("   (GB/s)\n");
+
+  for (const auto& corpus : corpora) {
+    size_t n = corpus.data.size();
+    for (size_t m : kNeedleSizes) {
+      if (n < 2 * m)
+        continue;
+      for (int which = 0; which < 3; ++which) {
+        // Hits copy a needle out of the corpus itself. Misses take bytes the
+        // corpus is made of, plus one that makes them absent, which is the
+        // hard case for the repetitive corpora.
+        std::vector<uint8_t> needle;
+        if (which < 2) {
+          size_t at = which == 0 ? n / 100 : n - n / 100 - m;
+          needle.assign(corpus.data.begin() + at,
+                        corpus.data.begin() + at + m);
+        } else {
+          needle.assign(corpus.data.begin() + n / 2,
+                        corpus.data.begin() + n / 2 + m);
+          for (int attempt = 0;
+               attempt < 256 && ReferenceSearch(corpus.data.data(), n,
+                                                needle.data(), m);
+               ++attempt) {
+            needle[m / 2] = (uint8_t)rng();
+          }
+        }
+
+        const uint8_t* expected =
+            ReferenceSearch(corpus.data.data(), n, needle.data(), m);
+        size_t scanned = expected ? expected - corpus.data.data() + m : n;
+
+        printf("%-18.18s %-5zu %-10s", corpus.name.c_str(), m, kCases[which]);
+        double reference_time = 0;
+        for (size_t k = 0; k < kernels.size(); ++k) {
+          const Kernel& kernel = kernels[k];
+          if (m < kernel.min_needle || m > kernel.max_needle) {
+            printf(" %14s", "-");
+            continue;
+          }
+          const uint8_t* result;
+          double time = TimeSearch(kernel, corpus, needle, &result);
+          if (k == 0)
+            reference_time = time;
+          worst_ratio[k] = (std::max)(worst_ratio[k], time / reference_time);
+          if (result != expected) {
+            ++failures;
+            printf(" %14s", "MISMATCH");
+          } else {
+            printf(" %14.2f", scanned / time / 1e9);
+          }
+        }
+        printf("\n");
+      }
+    }
+  }
+
+  printf("\nworst-case time ratio vs reference:\n");
+  for (size_t k = 1; k < kernels.size(); ++k) {
+    printf("  %-16s %8.2fx\n", kernels[k].name, worst_ratio[k]);
+  }
+  if (failures) {
+    printf("\n%d results differ from the reference\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,297 @@
+// Benchmark and differential check of the text kernels in textutils.h.
+//
+//   text_bench [--html file] [--size KB] [--cases N]
+//
+// compression_html() and ReplaceStringInPlace() are compared against the
+// line-splitting and find/replace versions they replaced on --cases random
+// inputs biased towards blanks, newlines and near matches, and every
+// CompressHtml kernel the CPU has must agree with them. Then each is timed
+// on an indented HTML document of --size KB (600 by default, about the size
+// of the settings bundle) or on --html, and reported as MB/s of input.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "textutils.h"
+
+namespace {
+
+// The versions before the streaming kernels, kept as the reference.
+std::vector<std::string> ReferenceSplit(const std::string& text, char sep) {
+  std::vector<std::string> tokens;
+  std::size_t start = 0, end = 0;
+  while ((end = text.find(sep, start)) != std::string::npos) {
+    tokens.push_back(text.substr(start, end - start));
+    start = end + 1;
+  }
+  tokens.push_back(text.substr(start));
+  return tokens;
+}
+
+void ReferenceCompressHtml(std::string& html) {
+  auto lines = ReferenceSplit(html, '\n');
+  html.clear();
+  for (auto& line : lines) {
+    html += "\n";
+    html += trim(line);
+  }
+}
+
+template <typename String>
+bool ReferenceReplace(String& subject,
+                      const String& search,
+                      const String& replace) {
+  bool find = false;
+  size_t pos = 0;
+  while ((pos = subject.find(search, pos)) != String::npos) {
+    subject.replace(pos, search.length(), replace);
+    pos += replace.length();
+    find = true;
+  }
+  return find;
+}
+
+struct Kernel {
+  const char* name;
+  CompressHtmlKernel compress;
+};
+
+std::vector<Kernel> Kernels() {
+  std::vector<Kernel> kernels = {{"scalar", ScalarCompressHtml}};
+#ifdef FASTSEARCH_X86
+  if (CpuSupportsSse2())
+    kernels.push_back({"sse2", Sse2CompressHtml});
+  if (CpuSupportsAvx2())
+    kernels.push_back({"avx2", Avx2CompressHtml});
+#endif
+  return kernels;
+}
+
+std::string RandomText(std::mt19937& rng, size_t size) {
+  static const char kAlphabet[] = " \t\n\r\v\f  \n\n<>ab\xA0\x85\"";
+  std::string text(size, ' ');
+  // Runs of one class, so that blocks start and end inside lines, blank
+  // runs and text alike.
+  for (size_t i = 0; i < size;) {
+    size_t run = 1 + rng() % 40;
+    char c = kAlphabet[rng() % (sizeof(kAlphabet) - 1)];
+    bool mixed = rng() % 2;
+    for (; run && i < size; --run, ++i) {
+      text[i] = mixed ? kAlphabet[rng() % (sizeof(kAlphabet) - 1)] : c;
+    }
+  }
+  return text;
+}
+
+int Check(int cases) {
+  std::mt19937 rng(20240601);
+  auto kernels = Kernels();
+  int failures = 0;
+  for (int i = 0; i < cases; ++i) {
+    size_t size = i < 100 ? (size_t)i : rng() % (i % 10 ? 300 : 5000);
+    std::string text = RandomText(rng, size);
+
+    std::string expected = text;
+    ReferenceCompressHtml(expected);
+    std::string actual = text;
+    compression_html(actual);
+    if (actual != expected)
+      ++failures;
+    for (const Kernel& kernel : kernels) {
+      std::string out(size + 1, '\0');
+      out.resize(kernel.compress((const uint8_t*)text.data(), size,
+                                 (uint8_t*)&out[0]));
+      if (out != expected) {
+        printf("%s differs on case %d of %zu bytes\n", kernel.name, i, size);
+        ++failures;
+      }
+    }
+
+    // Searches drawn from the text itself match often and overlap.
+    std::string search;
+    if (size && rng() % 4) {
+      size_t at = rng() % size;
+      search = text.substr(at, 1 + rng() % 6);
+    } else {
+      search = RandomText(rng, 1 + rng() % 3);
+    }
+    std::string replace = RandomText(rng, rng() % 9);
+    std::string reference = text;
+    std::string streamed = text;
+    bool reference_found = ReferenceReplace(reference, search, replace);
+    if (ReplaceStringInPlace(streamed, search, replace) != reference_found ||
+        streamed != reference) {
+      printf("ReplaceStringInPlace differs on case %d\n", i);
+      ++failures;
+    }
+    std::wstring wide(text.begin(), text.end());
+    std::wstring wide_search(search.begin(), search.end());
+    std::wstring wide_replace(replace.begin(), replace.end());
+    ReferenceReplace(wide, wide_search, wide_replace);
+    std::wstring wide_streamed(text.begin(), text.end());
+    ReplaceStringInPlace(wide_streamed, wide_search, wide_replace);
+    if (wide_streamed != wide) {
+      printf("wide ReplaceStringInPlace differs on case %d\n", i);
+      ++failures;
+    }
+  }
+  printf("%d cases checked against the reference, %d differ\n\n", cases,
+         failures);
+  return failures;
+}
+
+// Indented markup with blank lines and CRLF here and there.
+std::string SyntheticHtml(size_t size) {
+  std::mt19937 rng(7);
+  std::string html;
+  int depth = 0;
+  while (html.size() < size) {
+    html.append(2 * depth, ' ');
+    switch (rng() % 6) {
+      case 0:
+        html += "<div class=\"section\">";
+        depth = (std::min)(depth + 1, 12);
+        break;
+      case 1:
+        html += "</div>";
+        depth = (std::max)(depth - 1, 0);
+        break;
+      case 2:
+        html += "<settings-toggle-button hidden=\"[[!showUpdateStatus_]]\">";
+        break;
+      case 3:
+        html += "  \t";
+        break;
+      default:
+        html += "<span>$i18n{aboutBrowserVersion}</span>";
+        break;
+    }
+    html += rng() % 8 ? "\n" : "  \r\n";
+  }
+  return html;
+}
+
+bool ReadFile(const char* path, std::string* data) {
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return false;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  data->resize(size > 0 ? (size_t)size : 0);
+  bool ok = fread(&(*data)[0], 1, data->size(), file) == data->size();
+  fclose(file);
+  return ok;
+}
+
+// MB/s of `size` bytes for the best of a few runs of f.
+template <typename Function>
+double Throughput(size_t size, Function f) {
+  double best = 0;
+  for (int run = 0; run < 20; ++run) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    best = run ? (std::min)(best, seconds) : seconds;
+  }
+  return size / best / 1e6;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* html_path = nullptr;
+  size_t size = 600 << 10;
+  int cases = 20000;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--html") && i + 1 < argc) {
+      html_path = argv[++i];
+    } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+      size = (size_t)atoi(argv[++i]) << 10;
+    } else if (!strcmp(argv[i], "--cases") && i + 1 < argc) {
+      cases = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "usage: %s [--html file] [--size KB] [--cases N]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+
+  int failures = Check(cases);
+
+  std::string html;
+  if (html_path) {
+    if (!ReadFile(html_path, &html)) {
+      fprintf(stderr, "cannot read %s\n", html_path);
+      return 1;
+    }
+  } else {
+    html = SyntheticHtml(size);
+  }
+  std::string expected = html;
+  ReferenceCompressHtml(expected);
+  printf("%zu bytes of HTML, %zu compressed\n\n", html.size(),
+         expected.size());
+
+  printf("%-28s %10s\n", "compression_html", "MB/s");
+  printf("%-28s %10.0f\n", "reference", Throughput(html.size(), [&]() {
+           std::string copy = html;
+           ReferenceCompressHtml(copy);
+         }));
+  std::string out(html.size() + 1, '\0');
+  for (const Kernel& kernel : Kernels()) {
+    size_t out_size = 0;
+    double mbs = Throughput(html.size(), [&]() {
+      out_size = kernel.compress((const uint8_t*)html.data(), html.size(),
+                                 (uint8_t*)&out[0]);
+    });
+    if (expected.compare(0, std::string::npos, out.data(), out_size) != 0) {
+      printf("%s differs on the document\n", kernel.name);
+      ++failures;
+    }
+    printf("%-28s %10.0f\n", kernel.name, mbs);
+  }
+
+  struct Replacement {
+    const char* name;
+    std::string search;
+    std::string replace;
+  };
+  const Replacement kReplacements[] = {
+      {"shorter", R"(hidden="[[!showUpdateStatus_]]")", R"(hidden="true")"},
+      {"longer", "$i18n{aboutBrowserVersion}",
+       "$i18n{aboutBrowserVersion} Chrome++ modified version"},
+      {"missing", "</settings-about-page>", ""},
+  };
+  printf("\n%-28s %10s %10s\n", "ReplaceStringInPlace", "reference",
+         "streamed");
+  for (const Replacement& r : kReplacements) {
+    std::string reference = html;
+    std::string streamed = html;
+    ReferenceReplace(reference, r.search, r.replace);
+    ReplaceStringInPlace(streamed, r.search, r.replace);
+    if (streamed != reference) {
+      printf("%s differs on the document\n", r.name);
+      ++failures;
+    }
+    double reference_mbs = Throughput(html.size(), [&]() {
+      std::string copy = html;
+      ReferenceReplace(copy, r.search, r.replace);
+    });
+    double streamed_mbs = Throughput(html.size(), [&]() {
+      std::string copy = html;
+      ReplaceStringInPlace(copy, r.search, r.replace);
+    });
+    printf("%-28s %10.0f %10.0f\n", r.name, reference_mbs, streamed_mbs);
+  }
+  return failures ? 1 : 0;
+}
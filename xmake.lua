@@ -4,20 +4,39 @@ add_rules("mode.debug", "mode.release")
 
 set_warnings("more")
 
-add_defines("WIN32", "_WIN32")
-add_defines("UNICODE", "_UNICODE", "_CRT_SECURE_NO_WARNINGS", "_CRT_NONSTDC_NO_DEPRECATE")
+if is_plat("windows") then
+    add_defines("WIN32", "_WIN32")
+    add_defines("UNICODE", "_UNICODE", "_CRT_SECURE_NO_WARNINGS", "_CRT_NONSTDC_NO_DEPRECATE")
+end
 
 if is_mode("release") then
     add_defines("NDEBUG")
-    add_cxflags("/O2", "/Os", "/Gy", "/MT", "/EHsc", "/fp:precise")
-    add_ldflags("/DYNAMICBASE", "/LTCG")
+    if is_plat("windows") then
+        add_cxflags("/O2", "/Os", "/Gy", "/MT", "/EHsc", "/fp:precise")
+        add_ldflags("/DYNAMICBASE", "/LTCG")
+    end
 end
 
-add_cxflags("/utf-8")
+if is_plat("windows") then
+    add_cxflags("/utf-8")
+end
 
 -- add_links("gdiplus", "kernel32", "user32", "gdi32", "winspool", "comdlg32")
 -- add_links("advapi32", "shell32", "ole32", "oleaut32", "uuid", "odbc32", "odbccp32")
-add_links("kernel32", "user32", "shell32", "oleaut32", "propsys", "shlwapi", "crypt32", "advapi32", "netapi32")
+if is_plat("windows") then
+    add_links("kernel32", "user32", "shell32", "oleaut32", "propsys", "shlwapi", "crypt32", "advapi32", "netapi32")
+end
+
+option("brotli")
+    set_default(false)
+    set_showmenu(true)
+    set_description("Patch brotli-compressed pak resources too")
+    add_defines("PAK_BROTLI")
+option_end()
+
+if has_config("brotli") then
+    add_requires("brotli")
+end
 
 target("detours")
     set_kind("static")
@@ -34,7 +53,49 @@ target("chrome_plus")
     add_files("src/*.rc")
     add_links("user32")
     add_cxflags("/std:c++17")
+    add_options("brotli")
+    if has_config("brotli") then
+        add_packages("brotli")
+    end
     after_build(function (target)
         os.rm("$(buildir)/release/version.exp")
         os.rm("$(buildir)/release/version.lib")
-    end)
\ No newline at end of file
+    end)
+
+target("search_bench")
+    set_kind("binary")
+    set_default(false)
+    add_files("tools/search_bench.cpp")
+    add_includedirs("src")
+    set_languages("c++17")
+    if not is_plat("windows") then
+        add_syslinks("pthread")
+    end
+
+target("codec_bench")
+    set_kind("binary")
+    set_default(false)
+    add_files("tools/codec_bench.cpp")
+    add_includedirs("src")
+    set_languages("c++17")
+
+target("text_bench")
+    set_kind("binary")
+    set_default(false)
+    add_files("tools/text_bench.cpp")
+    add_includedirs("src")
+    set_languages("c++17")
+
+target("paktool")
+    set_kind("binary")
+    set_default(false)
+    add_files("tools/paktool.cpp")
+    add_includedirs("src")
+    set_languages("c++17")
+    add_options("brotli")
+    if has_config("brotli") then
+        add_packages("brotli")
+    end
+    if not is_plat("windows") then
+        add_syslinks("pthread")
+    end
\ No newline at end of file